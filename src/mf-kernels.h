@@ -0,0 +1,440 @@
+// SGD and dot product kernels, written once against the vector operations
+// of a struct Ops:
+//
+//   V, Mask     vector of Ops::width floats, and lane mask for loads/stores
+//   all()       mask of all lanes; first(n) masks the first n lanes
+//   zero(), set1(x), load(p, mask), loadu(p), store(p, v, mask)
+//               where load() and store() also convert from and to rows of
+//               bf16 and fp16, and the masks of a partial vector always
+//               cover kALIGN lanes
+//   add, sub, mul, max, rsqrt
+//   fmadd(a, b, c)   a*b+c, fused where the instruction set allows
+//   fnmadd(a, b, c)  c-a*b, likewise
+//   reduce(v)        sum of the lanes of v, in every lane
+//   lane0(v)         first lane of v
+//
+// mf.cpp includes this file once per instruction set, inside a namespace
+// that defines Ops and with RECO_TARGET set to the matching function
+// attribute, so there is deliberately no include guard. Instruction sets
+// whose vectors are 2*kALIGN floats wide also define
+// RECO_FUSED_ROW_UPDATE and provide blend(mask, a, b), which takes the
+// lanes of a in mask and those of b elsewhere. Those whose float loads take masks
+// of any first(n) lanes define RECO_MASKED_TAIL, and read the ends of
+// unaligned rows in one masked vector.
+
+RECO_TARGET RECO_INLINE mf_float hsum(Ops::V v)
+{
+    return Ops::lane0(Ops::reduce(v));
+}
+
+// One vector step of sg_update(). T is the storage type of the rows.
+template<typename T>
+RECO_TARGET RECO_INLINE void sg_update_step(
+    T *p,
+    T *q,
+    Ops::Mask mask,
+    Ops::V eta_p,
+    Ops::V eta_q,
+    Ops::V lambda,
+    Ops::V e,
+    Ops::V &pG1,
+    Ops::V &qG1,
+    bool do_nmf)
+{
+    Ops::V vp = Ops::load(p, mask);
+    Ops::V vq = Ops::load(q, mask);
+
+    Ops::V gp = Ops::fnmadd(e, vq, Ops::mul(lambda, vp));
+    Ops::V gq = Ops::fnmadd(e, vp, Ops::mul(lambda, vq));
+
+    pG1 = Ops::fmadd(gp, gp, pG1);
+    qG1 = Ops::fmadd(gq, gq, qG1);
+
+    vp = Ops::fnmadd(eta_p, gp, vp);
+    vq = Ops::fnmadd(eta_q, gq, vq);
+
+    if(do_nmf)
+    {
+        vp = Ops::max(vp, Ops::zero());
+        vq = Ops::max(vq, Ops::zero());
+    }
+
+    Ops::store(p, vp, mask);
+    Ops::store(q, vq, mask);
+}
+
+// Updates dimensions [d_begin, d_end) of p and q for a rating with error
+// e, and their AdaGrad accumulators pG and qG. d_begin and d_end are
+// multiples of kALIGN.
+template<typename T>
+RECO_TARGET RECO_INLINE void sg_update(
+    T *p,
+    T *q,
+    mf_float *pG,
+    mf_float *qG,
+    mf_int d_begin,
+    mf_int d_end,
+    Ops::V eta,
+    Ops::V lambda,
+    Ops::V e,
+    mf_float rk,
+    bool do_nmf)
+{
+    Ops::V eta_p = Ops::mul(eta, Ops::rsqrt(Ops::set1(*pG)));
+    Ops::V eta_q = Ops::mul(eta, Ops::rsqrt(Ops::set1(*qG)));
+    Ops::V pG1 = Ops::zero();
+    Ops::V qG1 = Ops::zero();
+
+    mf_int d = d_begin;
+    for(; d+Ops::width <= d_end; d += Ops::width)
+        sg_update_step(p+d, q+d, Ops::all(), eta_p, eta_q, lambda, e,
+                       pG1, qG1, do_nmf);
+
+    // Only vectors wider than kALIGN leave a partial vector at the end
+    if(d < d_end)
+        sg_update_step(p+d, q+d, Ops::first(d_end-d), eta_p, eta_q, lambda,
+                       e, pG1, qG1, do_nmf);
+
+    *pG += hsum(pG1)*rk;
+    *qG += hsum(qG1)*rk;
+}
+
+// Updates all the dimensions of p and q, the first kALIGN of them with
+// the accumulators pG[0] and qG[0] and the others with pG[1] and qG[1]
+template<typename T>
+RECO_TARGET RECO_INLINE void sg_update_row(
+    T *p,
+    T *q,
+    mf_float *pG,
+    mf_float *qG,
+    mf_int k,
+    Ops::V eta,
+    Ops::V lambda,
+    Ops::V e,
+    mf_float rk_slow,
+    mf_float rk_fast,
+    bool do_nmf)
+{
+#if defined RECO_FUSED_ROW_UPDATE
+    // The first vector spans both parts of the row, so it is updated with
+    // a learning rate per half. The fast part then continues at a whole
+    // vector boundary, instead of putting every access of it across two
+    // cache lines.
+    Ops::Mask slow = Ops::first(kALIGN);
+    Ops::V eta_p = Ops::mul(eta, Ops::rsqrt(
+        Ops::blend(slow, Ops::set1(pG[0]), Ops::set1(pG[1]))));
+    Ops::V eta_q = Ops::mul(eta, Ops::rsqrt(
+        Ops::blend(slow, Ops::set1(qG[0]), Ops::set1(qG[1]))));
+    Ops::V pG1 = Ops::zero();
+    Ops::V qG1 = Ops::zero();
+
+    sg_update_step(p, q, Ops::first(min(k, Ops::width)), eta_p, eta_q,
+                   lambda, e, pG1, qG1, do_nmf);
+    Ops::V pG_slow = Ops::blend(slow, pG1, Ops::zero());
+    Ops::V qG_slow = Ops::blend(slow, qG1, Ops::zero());
+    pG1 = Ops::sub(pG1, pG_slow);
+    qG1 = Ops::sub(qG1, qG_slow);
+
+    eta_p = Ops::mul(eta, Ops::rsqrt(Ops::set1(pG[1])));
+    eta_q = Ops::mul(eta, Ops::rsqrt(Ops::set1(qG[1])));
+
+    mf_int d = Ops::width;
+    for(; d+Ops::width <= k; d += Ops::width)
+        sg_update_step(p+d, q+d, Ops::all(), eta_p, eta_q, lambda, e,
+                       pG1, qG1, do_nmf);
+    if(d < k)
+        sg_update_step(p+d, q+d, Ops::first(k-d), eta_p, eta_q, lambda, e,
+                       pG1, qG1, do_nmf);
+
+    pG[0] += hsum(pG_slow)*rk_slow;
+    qG[0] += hsum(qG_slow)*rk_slow;
+    pG[1] += hsum(pG1)*rk_fast;
+    qG[1] += hsum(qG1)*rk_fast;
+#else
+    sg_update(p, q, pG, qG, 0, kALIGN, eta, lambda, e, rk_slow, do_nmf);
+    sg_update(p, q, pG+1, qG+1, kALIGN, k, eta, lambda, e, rk_fast, do_nmf);
+#endif
+}
+
+// Dot product of two aligned rows whose length is a multiple of kALIGN,
+// in every lane of the result. Two partial sums hide the latency of the
+// multiply-adds for long rows.
+template<typename T>
+RECO_TARGET RECO_INLINE Ops::V inner_product_v(T const *p, T const *q,
+                                               mf_int k)
+{
+    Ops::V acc0 = Ops::zero();
+    Ops::V acc1 = Ops::zero();
+
+    mf_int d = 0;
+    for(; d+2*Ops::width <= k; d += 2*Ops::width)
+    {
+        acc0 = Ops::fmadd(Ops::load(p+d, Ops::all()),
+                          Ops::load(q+d, Ops::all()), acc0);
+        acc1 = Ops::fmadd(Ops::load(p+d+Ops::width, Ops::all()),
+                          Ops::load(q+d+Ops::width, Ops::all()), acc1);
+    }
+    for(; d+Ops::width <= k; d += Ops::width)
+        acc0 = Ops::fmadd(Ops::load(p+d, Ops::all()),
+                          Ops::load(q+d, Ops::all()), acc0);
+    if(d < k)
+        acc1 = Ops::fmadd(Ops::load(p+d, Ops::first(k-d)),
+                          Ops::load(q+d, Ops::first(k-d)), acc1);
+
+    return Ops::reduce(Ops::add(acc0, acc1));
+}
+
+// inner_product_v() on rows of type T, for the kernel table
+template<typename T>
+RECO_TARGET mf_float inner_product(void const *p, void const *q, mf_int k)
+{
+    return Ops::lane0(inner_product_v((T const *)p, (T const *)q, k));
+}
+
+// Dot product of two rows of any length and alignment, such as the rows
+// of a trained model
+RECO_TARGET RECO_INLINE mf_float dot_product(mf_float const *p,
+                                             mf_float const *q, mf_int k)
+{
+    // Independent partial sums, so that consecutive multiplications do not
+    // wait for each other
+    Ops::V acc[4] = {Ops::zero(), Ops::zero(), Ops::zero(), Ops::zero()};
+
+    mf_int d = 0;
+    for(; d+4*Ops::width <= k; d += 4*Ops::width)
+        for(mf_int i = 0; i < 4; i++)
+            acc[i] = Ops::fmadd(Ops::loadu(p+d+i*Ops::width),
+                                Ops::loadu(q+d+i*Ops::width), acc[i]);
+    for(; d+Ops::width <= k; d += Ops::width)
+        acc[0] = Ops::fmadd(Ops::loadu(p+d), Ops::loadu(q+d), acc[0]);
+#if defined RECO_MASKED_TAIL
+    if(d < k)
+    {
+        acc[1] = Ops::fmadd(Ops::load(p+d, Ops::first(k-d)),
+                            Ops::load(q+d, Ops::first(k-d)), acc[1]);
+        d = k;
+    }
+#endif
+
+    mf_float product = hsum(Ops::add(Ops::add(acc[0], acc[1]),
+                                     Ops::add(acc[2], acc[3])));
+    for(; d < k; d++)
+        product += p[d]*q[d];
+    return product;
+}
+
+// Squared norm of an aligned row, as inner_product() of the row with
+// itself but loading it once
+template<typename T>
+RECO_TARGET mf_float sq_norm(void const *p_, mf_int k)
+{
+    T const *p = (T const *)p_;
+    Ops::V acc0 = Ops::zero();
+    Ops::V acc1 = Ops::zero();
+
+    mf_int d = 0;
+    for(; d+2*Ops::width <= k; d += 2*Ops::width)
+    {
+        Ops::V x0 = Ops::load(p+d, Ops::all());
+        Ops::V x1 = Ops::load(p+d+Ops::width, Ops::all());
+        acc0 = Ops::fmadd(x0, x0, acc0);
+        acc1 = Ops::fmadd(x1, x1, acc1);
+    }
+    for(; d+Ops::width <= k; d += Ops::width)
+    {
+        Ops::V x = Ops::load(p+d, Ops::all());
+        acc0 = Ops::fmadd(x, x, acc0);
+    }
+    if(d < k)
+    {
+        Ops::V x = Ops::load(p+d, Ops::first(k-d));
+        acc1 = Ops::fmadd(x, x, acc1);
+    }
+
+    return hsum(Ops::add(acc0, acc1));
+}
+
+// Squared norm of a row of any length and alignment, the counterpart of
+// dot_product()
+RECO_TARGET mf_float squared_norm(mf_float const *p, mf_int k)
+{
+    Ops::V acc[4] = {Ops::zero(), Ops::zero(), Ops::zero(), Ops::zero()};
+
+    mf_int d = 0;
+    for(; d+4*Ops::width <= k; d += 4*Ops::width)
+        for(mf_int i = 0; i < 4; i++)
+        {
+            Ops::V x = Ops::loadu(p+d+i*Ops::width);
+            acc[i] = Ops::fmadd(x, x, acc[i]);
+        }
+    for(; d+Ops::width <= k; d += Ops::width)
+    {
+        Ops::V x = Ops::loadu(p+d);
+        acc[0] = Ops::fmadd(x, x, acc[0]);
+    }
+#if defined RECO_MASKED_TAIL
+    if(d < k)
+    {
+        Ops::V x = Ops::load(p+d, Ops::first(k-d));
+        acc[1] = Ops::fmadd(x, x, acc[1]);
+        d = k;
+    }
+#endif
+
+    mf_float norm = hsum(Ops::add(Ops::add(acc[0], acc[1]),
+                                  Ops::add(acc[2], acc[3])));
+    for(; d < k; d++)
+        norm += p[d]*p[d];
+    return norm;
+}
+
+// dot_product() of p with each of the n rows of k floats that start at
+// Q, without a call per row
+RECO_TARGET void dot_rows(mf_float const *p, mf_float const *Q, mf_int n,
+                          mf_int k, mf_float *products)
+{
+    for(mf_int j = 0; j < n; j++)
+        products[j] = dot_product(p, Q+(mf_long)j*k, k);
+}
+
+// The SGD loop of one thread: takes blocks from the scheduler until none
+// is left, updating the factors of every rating in the block. T is the
+// storage type of P and Q. K is the aligned dimension, or 0 to read it
+// from the factors; with a fixed K the row loops have constant trip counts
+// and unroll completely. Implicit and Nmf fix the training mode, so the
+// loop body has no branches on it. Node is the layout of the blocks, and
+// thread the index of the calling thread for the scheduler. Jobs of the
+// first iteration only update the first kALIGN dimensions.
+template<typename T, mf_int K, bool Implicit, bool Nmf, typename Node>
+RECO_TARGET void sg(
+    Grid const &grid,
+    Factors &factors,
+    Scheduler &sched,
+    mf_parameter param,
+    mf_float *PG,
+    mf_float *QG,
+    Reco::MappedFile const *block_file,
+    mf_int thread)
+{
+    T *P = (T *)factors.P;
+    T *Q = (T *)factors.Q;
+    mf_int const k = (K > 0) ? K : factors.k;
+
+    Ops::V lambda = Ops::set1(param.lambda);
+    Ops::V eta = Ops::set1(param.eta);
+    mf_float rk_slow = (mf_float)1.0/kALIGN;
+    mf_float rk_fast = (mf_float)1.0/(k-kALIGN);
+
+    // Only one of u and v is sorted within a block, so the rows of a
+    // rating are mostly cache misses. They are prefetched a few ratings
+    // ahead, which overlaps the misses with the updates in between.
+    mf_int const distance = param.prefetch >= 0 ? param.prefetch :
+                                                  default_prefetch(k);
+    mf_long const row_bytes = (mf_long)k*sizeof(T);
+
+    while(true)
+    {
+        bool slow_only;
+        mf_int block = sched.get_job(thread, slow_only);
+        if(block < 0)
+            break;
+        if(block_file != nullptr)
+            prefetch_block(*block_file, grid.ptrs, sched.peek_job(thread));
+        mf_double loss = 0;
+        BlockNodes<Node> nodes(grid, block);
+        for(Node const *N = nodes.begin; N != nodes.end; N++)
+        {
+            if(distance > 0 && nodes.end-N > distance)
+            {
+                mf_int u = nodes.u(N[distance]);
+                mf_int v = nodes.v(N[distance]);
+                prefetch_row(P+(mf_long)u*k, row_bytes);
+                prefetch_row(Q+(mf_long)v*k, row_bytes);
+                prefetch_row(PG+u*2, 2*sizeof(mf_float));
+                prefetch_row(QG+v*2, 2*sizeof(mf_float));
+            }
+
+            mf_int u = nodes.u(*N);
+            mf_int v = nodes.v(*N);
+            mf_float r = nodes.r(*N);
+            T *p = P+(mf_long)u*k;
+            T *q = Q+(mf_long)v*k;
+            mf_float *pG = PG+u*2;
+            mf_float *qG = QG+v*2;
+
+            mf_float pref = r;
+            mf_float conf = 1;
+            if(Implicit)
+            {
+                pref = (r > 0) ? 1 : 0;
+                conf = 1+param.alpha*r;
+            }
+
+            // The error stays in a vector register for the updates, and
+            // only its first lane is read back for the loss
+            Ops::V e = Ops::sub(Ops::set1(pref), inner_product_v(p, q, k));
+            mf_float error = Ops::lane0(e);
+
+            loss += conf*error*error;
+
+            if(Implicit)
+                e = Ops::mul(e, Ops::set1(conf));
+
+            if(slow_only)
+                sg_update(p, q, pG, qG, 0, kALIGN, eta, lambda, e, rk_slow,
+                          Nmf);
+            else
+                sg_update_row(p, q, pG, qG, k, eta, lambda, e,
+                              rk_slow, rk_fast, Nmf);
+        }
+        sched.put_job(block, loss);
+    }
+}
+
+template<typename T, mf_int K, typename Node>
+SgKernel select_sg_mode(bool do_implicit, bool do_nmf)
+{
+    if(do_implicit)
+        return do_nmf ? sg<T, K, true, true, Node> :
+                        sg<T, K, true, false, Node>;
+    return do_nmf ? sg<T, K, false, true, Node> :
+                    sg<T, K, false, false, Node>;
+}
+
+// Unpacked grids, which are only used on disk and for the few problems
+// that cannot be packed, and rows of reduced precision are only trained
+// with the K = 0 instantiations, which keeps the number of instantiations
+// down
+SgKernel select_sg(bool packed, mf_int k, mf_int precision,
+                   bool do_implicit, bool do_nmf)
+{
+    if(!packed)
+    {
+        if(precision == MF_BF16)
+            return select_sg_mode<bf16, 0, mf_node>(do_implicit, do_nmf);
+        if(precision == MF_FP16)
+            return select_sg_mode<fp16, 0, mf_node>(do_implicit, do_nmf);
+        return select_sg_mode<mf_float, 0, mf_node>(do_implicit, do_nmf);
+    }
+
+    if(precision == MF_BF16)
+        return select_sg_mode<bf16, 0, PackedNode>(do_implicit, do_nmf);
+    if(precision == MF_FP16)
+        return select_sg_mode<fp16, 0, PackedNode>(do_implicit, do_nmf);
+
+    switch(k)
+    {
+        case 8:
+            return select_sg_mode<mf_float, 8, PackedNode>(do_implicit, do_nmf);
+        case 16:
+            return select_sg_mode<mf_float, 16, PackedNode>(do_implicit, do_nmf);
+        case 32:
+            return select_sg_mode<mf_float, 32, PackedNode>(do_implicit, do_nmf);
+        case 64:
+            return select_sg_mode<mf_float, 64, PackedNode>(do_implicit, do_nmf);
+        case 128:
+            return select_sg_mode<mf_float, 128, PackedNode>(do_implicit, do_nmf);
+        default:
+            return select_sg_mode<mf_float, 0, PackedNode>(do_implicit, do_nmf);
+    }
+}
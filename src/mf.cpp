@@ -1,12 +1,17 @@
 #include <algorithm>
+#include <atomic>
 #include <iomanip>
 #include <iostream>
+#include <limits>
 #include <numeric>
-#include <queue>
-#include <unordered_set>
 #include <random>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
 #include <cstring>
 #include <fstream>
+#include <functional>
 #include <vector>
 #include <new>
 #include <string>
@@ -16,15 +21,32 @@
 #include <Rcpp.h>
 // For additional functions needed for R package
 #include "reco-utils.h"
+#include "reco-mmap.h"
+#include "reco-numa.h"
+#include "reco-text.h"
 
 #include "mf.h"
 
-#if defined USESSE
-#include <pmmintrin.h>
-#endif
-
-#if defined USEAVX
-#include <immintrin.h>
+// The SIMD kernels are compiled with function target attributes, so the
+// package itself needs no -m flags. AVX registers are not spilled to
+// properly aligned stack slots by the MinGW compilers, so Windows builds
+// only get the SSE kernels.
+#if (defined __x86_64__ || defined __i386__) && \
+    (defined __clang__ || (defined __GNUC__ && __GNUC__ >= 5))
+  #define RECO_X86_SIMD
+  #include <immintrin.h>
+  #ifndef _WIN32
+    #define RECO_X86_WIDE
+    // The F16C check of __builtin_cpu_supports arrived in GCC 11, older
+    // compilers read the CPUID bit instead
+    #if !defined __clang__ && __GNUC__ < 11
+      #include <cpuid.h>
+    #endif
+    // The VNNI intrinsics and their CPU check arrived in GCC 8
+    #if defined __clang__ || __GNUC__ >= 8
+      #define RECO_X86_VNNI
+    #endif
+  #endif
 #endif
 
 // _OPENMP will be defined if OpenMP is enabled,
@@ -47,8 +69,10 @@
 
 #ifdef USE_PTHREADS
   #include <pthread.h>
+  #include <sched.h>
 #else
   #include <condition_variable>
+  #include <mutex>
   #include <thread>
 #endif
 
@@ -64,688 +88,2013 @@ namespace
 mf_int const kALIGNByte = 32;
 mf_int const kALIGN = kALIGNByte/sizeof(mf_float);
 
-class Scheduler
+// Alignment of the factor matrices allocated for training. Rows of a
+// multiple of 16 floats then start on a cache line, which is also the
+// width of an AVX-512 vector.
+mf_int const kAllocByte = 64;
+mf_int const kCacheLineByte = 64;
+
+// Targets for training on disk: the average size of a grid block, and
+// the total size of the write buffers used to build the block file
+mf_long const kDiskBlockBytes = 1 << 24;
+mf_long const kDiskBufferBytes = 1 << 26;
+
+// Header of the binary model file. P and Q follow as m*k and n*k floats,
+// each starting at a multiple of kALIGNByte, so that a mapping of the
+// file can serve as the model directly.
+struct ModelHeader
+{
+    char magic[8];
+    mf_int version;
+    mf_int m;
+    mf_int n;
+    mf_int k;
+    mf_long p_offset;
+    mf_long q_offset;
+    char reserved[24];
+};
+
+char const kModelMagic[8] = {'R', 'E', 'C', 'O', 'M', 'D', 'L', '\0'};
+mf_int const kModelVersion = 1;
+
+static_assert(sizeof(ModelHeader) % kALIGNByte == 0,
+              "model header breaks the alignment of P");
+
+// Header of the int8 model file. The scales of P and Q follow as m and n
+// floats, then the rows of P and Q as m*k and n*k signed bytes, each array
+// starting at a multiple of kALIGNByte.
+struct QModelHeader
+{
+    char magic[8];
+    mf_int version;
+    mf_int m;
+    mf_int n;
+    mf_int k;
+    mf_long p_scale_offset;
+    mf_long q_scale_offset;
+    mf_long p_offset;
+    mf_long q_offset;
+    char reserved[8];
+};
+
+char const kQModelMagic[8] = {'R', 'E', 'C', 'O', 'Q', '8', '\0', '\0'};
+mf_int const kQModelVersion = 1;
+
+static_assert(sizeof(QModelHeader) % kALIGNByte == 0,
+              "int8 model header breaks the alignment of the scales");
+
+void yield_thread()
 {
-public:
-    Scheduler(mf_int nr_bins, mf_int nr_threads, vector<mf_int> cv_blocks);
 #ifdef USE_PTHREADS
-    ~Scheduler();
+    sched_yield();
+#else
+    this_thread::yield();
 #endif
-    mf_int get_job();
+}
+
+// Hands out the blocks of the grid to the threads of fpsg(), so that no two
+// running blocks share a row or column bin. Each thread owns the blocks of
+// some row bins, which it works through in a random order, and takes the
+// blocks of other threads once none of its own is free. Bins are claimed
+// in atomic bitmaps and jobs counted in atomics.
+//
+// There is no barrier between iterations: the nr_bins*nr_bins jobs of each
+// iteration are numbered in one sequence, and a block may be taken as soon
+// as its count is below that of the iteration of the last job started, so
+// threads move on to the next iteration while the last blocks of the
+// previous one run. The thread that completes the last job of an iteration
+// calls iter_done, if given, with the iteration and the loss. The jobs of
+// the next iteration are then held until iter_done returns, so it sees the
+// factors as they are at the end of the iteration. Meanwhile the other
+// threads call while_held, if given, to share its work, instead of only
+// yielding.
+//
+// With deterministic, the jobs of every iteration instead run in nr_bins
+// waves of nr_bins blocks that share no bin, in an order drawn from the
+// seed, and each wave starts once the one before is done. Every block is
+// then trained on the same factors whatever the timing of the threads.
+class Scheduler
+{
+public:
+    Scheduler(mf_int nr_bins, mf_int nr_threads, mf_int nr_iters,
+              vector<mf_int> cv_blocks, bool deterministic,
+              vector<mf_int> bin_nodes = vector<mf_int>(),
+              vector<mf_int> thread_nodes = vector<mf_int>(),
+              function<void(mf_int, mf_double)> iter_done = nullptr,
+              function<void()> while_held = nullptr);
+    mf_int get_job(mf_int thread, bool &first_iter);
+    mf_int peek_job(mf_int thread);
     void put_job(mf_int block, mf_double loss);
     mf_double get_loss();
-    void wait_for_jobs_done();
-    void resume();
-    void terminate();
-    bool is_terminated();
 
 private:
+    // Where a thread resumes the scan of its own blocks, padded so that
+    // the cursors of two threads never share a cache line
+    struct Cursor
+    {
+        mf_int pos;
+        char padding[64-sizeof(mf_int)];
+    };
+
+    bool claim(vector<atomic<uint64_t>> &bins, mf_int bin);
+    void release(vector<atomic<uint64_t>> &bins, mf_int bin);
+    bool try_job(mf_int block, mf_int max_count);
+    mf_int max_count(mf_long job);
+    mf_long reserve_job();
+    mf_int wave_block(mf_long job);
+    void finish_job();
+
     mf_int nr_bins;
     mf_int nr_threads;
-    mf_int nr_done_jobs;
-    mf_int target;
-    mf_int nr_paused_threads;
-    bool terminated;
-    vector<mf_int> counts;
-    vector<mf_int> busy_p_blocks;
-    vector<mf_int> busy_q_blocks;
-    vector<mf_double> block_losses;
-    unordered_set<mf_int> cv_blocks;
-#ifdef USE_PTHREADS
-    pthread_mutex_t mtx;
-    pthread_cond_t cond_var;
-#else
-    mutex mtx;
-    condition_variable cond_var;
-#endif
-    priority_queue<pair<mf_float, mf_int>,
-                   vector<pair<mf_float, mf_int>>,
-                   greater<pair<mf_float, mf_int>>> pq;
+    mf_int nr_blocks;
+    mf_long nr_jobs;
+    atomic<mf_long> nr_held_jobs;
+    atomic<mf_long> nr_started_jobs;
+    atomic<mf_long> nr_done_jobs;
+    vector<atomic<mf_int>> counts;
+    vector<atomic<uint64_t>> busy_p_bins;
+    vector<atomic<uint64_t>> busy_q_bins;
+    vector<atomic<mf_double>> block_losses;
+    vector<vector<mf_int>> own_blocks;
+    vector<vector<mf_int>> victims;
+    vector<Cursor> cursors;
+    function<void(mf_int, mf_double)> iter_done;
+    function<void()> while_held;
+    bool deterministic;
+    vector<bool> is_cv;
+    vector<mf_int> wave_cols;
+    vector<mf_int> wave_shifts;
 };
 
-Scheduler::Scheduler(mf_int nr_bins, mf_int nr_threads, vector<mf_int> cv_blocks)
+// Row bins go round robin to the threads, or, with bin_nodes and
+// thread_nodes given, to the threads of the NUMA node of the bin, which
+// also work through the blocks with their column bin on the node first
+// and take blocks from the other threads of the node first.
+Scheduler::Scheduler(mf_int nr_bins, mf_int nr_threads, mf_int nr_iters,
+                     vector<mf_int> cv_blocks, bool deterministic,
+                     vector<mf_int> bin_nodes, vector<mf_int> thread_nodes,
+                     function<void(mf_int, mf_double)> iter_done,
+                     function<void()> while_held)
     : nr_bins(nr_bins),
       nr_threads(nr_threads),
+      nr_blocks(nr_bins*nr_bins),
+      nr_jobs((mf_long)nr_iters*nr_bins*nr_bins),
+      nr_held_jobs(iter_done ? std::min((mf_long)nr_bins*nr_bins, nr_jobs)
+                             : nr_jobs),
+      nr_started_jobs(0),
       nr_done_jobs(0),
-      target(nr_bins*nr_bins),
-      nr_paused_threads(0),
-      terminated(false),
-      counts(nr_bins*nr_bins, 0),
-      busy_p_blocks(nr_bins, 0),
-      busy_q_blocks(nr_bins, 0),
-      block_losses(nr_bins*nr_bins, 0),
-      cv_blocks(cv_blocks.begin(), cv_blocks.end())
-{
-    for(mf_int i = 0; i < nr_bins*nr_bins; i++)
-        if(this->cv_blocks.find(i) == this->cv_blocks.end())
-            pq.emplace(mf_float(Reco::rand_unif()), i);
-#ifdef USE_PTHREADS
-    pthread_mutex_init(&mtx, NULL);
-    pthread_cond_init(&cond_var, NULL);
-#endif
+      counts(nr_bins*nr_bins),
+      busy_p_bins((nr_bins+63)/64),
+      busy_q_bins((nr_bins+63)/64),
+      block_losses(nr_bins*nr_bins),
+      own_blocks(nr_threads),
+      victims(nr_threads),
+      cursors(nr_threads),
+      iter_done(iter_done),
+      while_held(while_held),
+      deterministic(deterministic),
+      is_cv(nr_bins*nr_bins, false)
+{
+    bool numa = !bin_nodes.empty() && !thread_nodes.empty();
+    auto same_node = [&] (mf_int t1, mf_int t2)
+    {
+        return numa && thread_nodes[t1] == thread_nodes[t2];
+    };
+
+    vector<mf_int> bin_owners(nr_bins);
+    for(mf_int bin = 0; bin < nr_bins; bin++)
+        bin_owners[bin] = bin%nr_threads;
+    if(numa)
+    {
+        mf_int nr_nodes = *max_element(bin_nodes.begin(), bin_nodes.end())+1;
+        vector<vector<mf_int>> node_threads(nr_nodes);
+        for(mf_int t = 0; t < nr_threads; t++)
+            if(thread_nodes[t] < nr_nodes)
+                node_threads[thread_nodes[t]].push_back(t);
+
+        vector<mf_int> nr_dealt(nr_nodes, 0);
+        for(mf_int bin = 0; bin < nr_bins; bin++)
+        {
+            mf_int node = bin_nodes[bin];
+            if(!node_threads[node].empty())
+                bin_owners[bin] = node_threads[node][
+                    nr_dealt[node]++%node_threads[node].size()];
+        }
+    }
+
+    for(mf_int block : cv_blocks)
+        is_cv[block] = true;
+    for(mf_int block = 0; block < nr_bins*nr_bins; block++)
+        if(!is_cv[block])
+            own_blocks[bin_owners[block/nr_bins]].push_back(block);
+        else
+            nr_blocks--;
+
+    Reco::Rng rng(Reco::rand_seed());
+    for(mf_int t = 0; t < nr_threads; t++)
+    {
+        vector<mf_int> &blocks = own_blocks[t];
+        for(mf_int i = (mf_int)blocks.size()-1; i > 0; i--)
+            swap(blocks[i], blocks[rng.next()%(i+1)]);
+        if(numa)
+            stable_partition(blocks.begin(), blocks.end(), [&] (mf_int block)
+            {
+                return bin_nodes[block%nr_bins] == thread_nodes[t];
+            });
+
+        for(mf_int i = 1; i < nr_threads; i++)
+            if(same_node(t, (t+i)%nr_threads))
+                victims[t].push_back((t+i)%nr_threads);
+        for(mf_int i = 1; i < nr_threads; i++)
+            if(!same_node(t, (t+i)%nr_threads))
+                victims[t].push_back((t+i)%nr_threads);
+        cursors[t].pos = 0;
+    }
+
+    // Wave w of iteration iter takes, in row bin i, column bin
+    // wave_cols[iter*nr_bins+(i+wave_shifts[iter*nr_bins+w])%nr_bins]
+    if(deterministic)
+    {
+        auto shuffle_bins = [&] (mf_int *bins)
+        {
+            iota(bins, bins+nr_bins, 0);
+            for(mf_int i = nr_bins-1; i > 0; i--)
+                swap(bins[i], bins[rng.next()%(i+1)]);
+        };
+
+        wave_cols.resize((mf_long)nr_iters*nr_bins);
+        wave_shifts.resize((mf_long)nr_iters*nr_bins);
+        for(mf_long iter = 0; iter < nr_iters; iter++)
+        {
+            shuffle_bins(&wave_cols[iter*nr_bins]);
+            shuffle_bins(&wave_shifts[iter*nr_bins]);
+        }
+    }
 }
 
-#ifdef USE_PTHREADS
-Scheduler::~Scheduler()
+bool Scheduler::claim(vector<atomic<uint64_t>> &bins, mf_int bin)
 {
-    pthread_mutex_destroy(&mtx);
-    pthread_cond_destroy(&cond_var);
+    uint64_t mask = (uint64_t)1 << (bin%64);
+    atomic<uint64_t> &word = bins[bin/64];
+    return !(word.load(memory_order_relaxed) & mask) &&
+           !(word.fetch_or(mask, memory_order_acquire) & mask);
 }
-#endif
 
-mf_int Scheduler::get_job()
+void Scheduler::release(vector<atomic<uint64_t>> &bins, mf_int bin)
 {
-#ifdef USE_PTHREADS
-    pthread_mutex_lock(&mtx);
-#else
-    lock_guard<mutex> lock(mtx);
-#endif
-    vector<pair<mf_float, mf_int>> locked_blocks;
+    uint64_t mask = (uint64_t)1 << (bin%64);
+    bins[bin/64].fetch_and(~mask, memory_order_release);
+}
 
-    while(true)
+// The number of times that a block may have been processed by the end of
+// the iteration of the job, which spreads the nr_bins*nr_bins jobs of every
+// iteration evenly over the blocks left out of cross validation
+mf_int Scheduler::max_count(mf_long job)
+{
+    mf_long nr_iter_jobs = (job/(nr_bins*nr_bins)+1)*nr_bins*nr_bins;
+    return (mf_int)((nr_iter_jobs+nr_blocks-1)/nr_blocks);
+}
+
+// Claims the row and column bins of the block and counts a job on it,
+// unless a bin is busy or the block has been processed max_count times
+bool Scheduler::try_job(mf_int block, mf_int max_count)
+{
+    if(counts[block].load(memory_order_relaxed) >= max_count)
+        return false;
+
+    mf_int p_bin = block/nr_bins;
+    mf_int q_bin = block%nr_bins;
+    if(!claim(busy_p_bins, p_bin))
+        return false;
+    if(!claim(busy_q_bins, q_bin))
     {
-        pair<mf_float, mf_int> block = pq.top();
-        pq.pop();
-        mf_int p_block = block.second/nr_bins;
-        mf_int q_block = block.second%nr_bins;
-        if(busy_p_blocks[p_block] || busy_q_blocks[q_block])
-        {
-            locked_blocks.push_back(block);
-            continue;
-        }
-        for(auto &block : locked_blocks)
-            pq.push(block);
-        busy_p_blocks[p_block] = 1;
-        busy_q_blocks[q_block] = 1;
-        counts[block.second]++;
-#ifdef USE_PTHREADS
-        pthread_mutex_unlock(&mtx);
-#endif
-        return block.second;
+        release(busy_p_bins, p_bin);
+        return false;
+    }
+
+    // No other thread can take the block while its row bin is held
+    if(counts[block].load(memory_order_relaxed) >= max_count)
+    {
+        release(busy_q_bins, q_bin);
+        release(busy_p_bins, p_bin);
+        return false;
     }
+    counts[block].fetch_add(1, memory_order_relaxed);
+    return true;
 }
 
-void Scheduler::put_job(mf_int block_idx, mf_double loss)
+// Returns a block for the thread, or -1 once all the jobs of the last
+// iteration have been started. first_iter tells whether the job is one of
+// the first iteration.
+mf_int Scheduler::get_job(mf_int thread, bool &first_iter)
 {
-#ifdef USE_PTHREADS
-    pthread_mutex_lock(&mtx);
-    busy_p_blocks[block_idx/nr_bins] = 0;
-    busy_q_blocks[block_idx%nr_bins] = 0;
-    block_losses[block_idx] = loss;
-    nr_done_jobs++;
-    mf_float priority = (mf_float)counts[block_idx]+(mf_float)(Reco::rand_unif());
-    pq.emplace(priority, block_idx);
-    nr_paused_threads++;
-    pthread_cond_broadcast(&cond_var);
-    pthread_mutex_unlock(&mtx);
-
-    pthread_mutex_lock(&mtx);
-    while(nr_done_jobs >= target)
-    {
-        pthread_cond_wait(&cond_var, &mtx);
-    }
-    pthread_mutex_unlock(&mtx);
-
-    pthread_mutex_lock(&mtx);
-    --nr_paused_threads;
-    pthread_mutex_unlock(&mtx);
-#else
+    mf_long job = reserve_job();
+    if(job < 0)
+        return -1;
+    first_iter = job < nr_bins*nr_bins;
+
+    // The jobs of a wave are taken once the waves before are done, and
+    // those of blocks left out for cross validation are passed over
+    if(deterministic)
     {
-        lock_guard<mutex> lock(mtx);
-        busy_p_blocks[block_idx/nr_bins] = 0;
-        busy_q_blocks[block_idx%nr_bins] = 0;
-        block_losses[block_idx] = loss;
-        nr_done_jobs++;
-        mf_float priority = (mf_float)counts[block_idx]+(mf_float)(Reco::rand_unif());
-        pq.emplace(priority, block_idx);
-        nr_paused_threads++;
-        cond_var.notify_all();
+        while(true)
+        {
+            while(nr_done_jobs.load() < job/nr_bins*nr_bins)
+                yield_thread();
+            mf_int block = wave_block(job);
+            if(!is_cv[block])
+                return block;
+
+            finish_job();
+            job = reserve_job();
+            if(job < 0)
+                return -1;
+            first_iter = job < nr_bins*nr_bins;
+        }
     }
 
+    // A job has been reserved, so some block is below the max_count of the
+    // last job reserved, and it is handed out as soon as its bins are free.
+    // The limit of the own job of the thread would not do, as threads in
+    // the next iteration may have taken the last blocks below it. Blocks
+    // processed fewer times than the average, which fell behind in the
+    // previous iteration or, with blocks left out for cross validation,
+    // because the jobs of an iteration do not divide evenly, are taken
+    // first.
+    vector<mf_int> const &blocks = own_blocks[thread];
+    mf_int nr_own = (mf_int)blocks.size();
+    mf_int &pos = cursors[thread].pos;
+    while(true)
     {
-        unique_lock<mutex> lock(mtx);
-        cond_var.wait(lock, [&] {
-            return nr_done_jobs < target;
-        });
+        mf_long last_job = nr_started_jobs.load()-1;
+        mf_int max = max_count(last_job);
+        mf_int min = std::max((mf_int)((last_job+1)/nr_blocks), 1);
+        for(mf_int level = min; level <= max; level++)
+        {
+            for(mf_int i = 0; i < nr_own; i++)
+            {
+                mf_int j = (pos+i)%nr_own;
+                if(try_job(blocks[j], level))
+                {
+                    pos = j+1;
+                    return blocks[j];
+                }
+            }
+
+            for(mf_int victim : victims[thread])
+                for(mf_int block : own_blocks[victim])
+                    if(try_job(block, level))
+                        return block;
+        }
+
+        yield_thread();
     }
+}
 
+// Counts a job as started and returns its number, or -1 once all of them
+// are. Held jobs are waited for.
+mf_long Scheduler::reserve_job()
+{
+    mf_long job = nr_started_jobs.load();
+    while(true)
     {
-        lock_guard<mutex> lock(mtx);
-        --nr_paused_threads;
+        if(job >= nr_jobs)
+            return -1;
+        if(job >= nr_held_jobs.load())
+        {
+            if(while_held)
+                while_held();
+            else
+                yield_thread();
+            job = nr_started_jobs.load();
+        }
+        else if(nr_started_jobs.compare_exchange_weak(job, job+1))
+            return job;
     }
-#endif
 }
 
-mf_double Scheduler::get_loss()
+mf_int Scheduler::wave_block(mf_long job)
 {
-#ifdef USE_PTHREADS
-    pthread_mutex_lock(&mtx);
-    mf_double res = accumulate(block_losses.begin(), block_losses.end(), 0.0);
-    pthread_mutex_unlock(&mtx);
-    return res;
-#else
-    lock_guard<mutex> lock(mtx);
-    return accumulate(block_losses.begin(), block_losses.end(), 0.0);
-#endif
+    mf_long iter = job/(nr_bins*nr_bins);
+    mf_int wave = (mf_int)(job/nr_bins%nr_bins);
+    mf_int p_bin = (mf_int)(job%nr_bins);
+    mf_int shift = wave_shifts[iter*nr_bins+wave];
+    return p_bin*nr_bins+wave_cols[iter*nr_bins+(p_bin+shift)%nr_bins];
 }
 
-void Scheduler::wait_for_jobs_done()
+// The block that the thread will probably get next, to prefetch it from
+// disk. Returns -1 if it has none of its own left in the iteration.
+mf_int Scheduler::peek_job(mf_int thread)
 {
-#ifdef USE_PTHREADS
-    pthread_mutex_lock(&mtx);
-
-    while(nr_done_jobs < target)
+    if(deterministic)
     {
-        pthread_cond_wait(&cond_var, &mtx);
+        mf_long job = nr_started_jobs.load();
+        return job < nr_jobs ? wave_block(job) : -1;
     }
 
-    while(nr_paused_threads != nr_threads)
+    mf_int max = max_count(nr_started_jobs.load()-1);
+    vector<mf_int> const &blocks = own_blocks[thread];
+    mf_int nr_own = (mf_int)blocks.size();
+    for(mf_int i = 0; i < nr_own; i++)
     {
-        pthread_cond_wait(&cond_var, &mtx);
+        mf_int block = blocks[(cursors[thread].pos+i)%nr_own];
+        if(counts[block].load(memory_order_relaxed) < max)
+            return block;
     }
-
-    pthread_mutex_unlock(&mtx);
-#else
-    unique_lock<mutex> lock(mtx);
-
-    cond_var.wait(lock, [&] {
-        return nr_done_jobs >= target;
-    });
-
-    cond_var.wait(lock, [&] {
-        return nr_paused_threads == nr_threads;
-    });
-#endif
+    return -1;
 }
 
-void Scheduler::resume()
+void Scheduler::put_job(mf_int block, mf_double loss)
 {
-#ifdef USE_PTHREADS
-    pthread_mutex_lock(&mtx);
-    target += nr_bins*nr_bins;
-    pthread_cond_broadcast(&cond_var);
-    pthread_mutex_unlock(&mtx);
-#else
-    lock_guard<mutex> lock(mtx);
-    target += nr_bins*nr_bins;
-    cond_var.notify_all();
-#endif
+    block_losses[block].store(loss, memory_order_relaxed);
+    if(!deterministic)
+    {
+        release(busy_q_bins, block%nr_bins);
+        release(busy_p_bins, block/nr_bins);
+    }
+    finish_job();
 }
 
-void Scheduler::terminate()
+void Scheduler::finish_job()
 {
-#ifdef USE_PTHREADS
-    pthread_mutex_lock(&mtx);
-    terminated = true;
-    pthread_mutex_unlock(&mtx);
-#else
-    lock_guard<mutex> lock(mtx);
-    terminated = true;
-#endif
+    mf_long nr_done = nr_done_jobs.fetch_add(1)+1;
+    if(iter_done && nr_done%(nr_bins*nr_bins) == 0)
+    {
+        iter_done((mf_int)(nr_done/(nr_bins*nr_bins))-1, get_loss());
+        nr_held_jobs.store(std::min(nr_done+nr_bins*nr_bins, nr_jobs));
+    }
 }
 
-bool Scheduler::is_terminated()
+// The latest loss of every block, a mix of two iterations while the
+// threads run
+mf_double Scheduler::get_loss()
 {
-#ifdef USE_PTHREADS
-    pthread_mutex_lock(&mtx);
-    bool res = terminated;
-    pthread_mutex_unlock(&mtx);
-    return res;
-#else
-    lock_guard<mutex> lock(mtx);
-    return terminated;
-#endif
+    mf_double loss = 0;
+    for(auto &block_loss : block_losses)
+        loss += block_loss.load(memory_order_relaxed);
+    return loss;
 }
 
-mf_float* malloc_aligned_float(mf_long size)
+void *malloc_aligned_memory(mf_long bytes)
 {
     void *ptr;
 #ifdef _WIN32
-    ptr = _aligned_malloc(size*sizeof(mf_float), kALIGNByte);
+    ptr = _aligned_malloc(bytes, kAllocByte);
     if(ptr == nullptr)
         throw bad_alloc();
 #elif defined(posix_memalign)
-    int status = posix_memalign(&ptr, kALIGNByte, size*sizeof(mf_float));
+    int status = posix_memalign(&ptr, kAllocByte, bytes);
     if(status != 0)
         throw bad_alloc();
 #else
-    ptr = Reco::malloc_aligned(kALIGNByte, size*sizeof(mf_float));
+    ptr = Reco::malloc_aligned(kAllocByte, bytes);
     if(ptr == nullptr)
         throw bad_alloc();
 #endif
 
-    return (mf_float*)ptr;
+    return ptr;
 }
 
-mf_model* init_model(mf_int m, mf_int n, mf_int k_real, mf_int k_aligned)
+void free_aligned_memory(void *ptr)
 {
-    mf_model *model = new mf_model;
-    model->m = m;
-    model->n = n;
-    model->k = k_aligned;
-    model->P = nullptr;
-    model->Q = nullptr;
+#ifdef _WIN32
+    _aligned_free(ptr);
+#elif defined(posix_memalign)
+    free(ptr);
+#else
+    Reco::free_aligned(ptr);
+#endif
+}
 
-    mf_float scale = sqrt(1.0/k_real);
+mf_float* malloc_aligned_float(mf_long size)
+{
+    return (mf_float*)malloc_aligned_memory(size*sizeof(mf_float));
+}
 
-    try
-    {
-        model->P = malloc_aligned_float((mf_long)m*model->k);
-        model->Q = malloc_aligned_float((mf_long)n*model->k);
-    }
-    catch(bad_alloc const &e)
-    {
-        mf_destroy_model(&model);
-        throw;
-    }
+// The threads of training: the workers of fpsg(), the placement of NUMA
+// data and the parallel loops that prepare the data and evaluate the
+// model, shared by all the models trained in the process, so that cross
+// validation and tuning, which train one per fold, do not create threads
+// for each. The pool grows to the largest number of tasks run at once.
+class ThreadPool
+{
+public:
+    ThreadPool();
+    ~ThreadPool();
+
+    // Calls task(i) for i in [0, nr_tasks), each on its own thread of the
+    // pool, and returns at once. join() waits for them to return. Tasks
+    // are run by one caller at a time.
+    void start(mf_int nr_tasks, function<void(mf_int)> task);
+    void join();
 
-    auto init1 = [&] (mf_float *ptr, mf_int count)
+    // Calls task(i) for i in [0, nr_threads), task(0) on the calling
+    // thread and the others on the pool, and waits for them to return
+    void run(mf_int nr_threads, function<void(mf_int)> task);
+
+    // The number of threads of the parallel loops, the caller included,
+    // which fpsg() sets to that of training
+    void set_nr_threads(mf_int nr_threads) { nr_loop_threads = nr_threads; }
+    mf_int get_nr_threads() const { return nr_loop_threads; }
+
+private:
+    void work(mf_int id, mf_long generation);
+    void lock();
+    void unlock();
+    void wait();
+    void notify_all();
+
+    function<void(mf_int)> task;
+    mf_int nr_tasks;
+    mf_int nr_running;
+    mf_long generation;
+    bool stopping;
+    mf_int nr_loop_threads;
+#ifdef USE_PTHREADS
+    struct Start
     {
-        for(mf_int i = 0; i < count; i++)
-        {
-            mf_long d = 0;
-            for(; d < k_real; d++, ptr++)
-                *ptr = (mf_float)(Reco::rand_unif()*scale);
-            for(; d < k_aligned; d++, ptr++)
-                *ptr = 0;
-        }
+        ThreadPool *pool;
+        mf_int id;
+        mf_long generation;
     };
+    static void *run(void *data);
 
-    init1(model->P, m);
-    init1(model->Q, n);
+    vector<pthread_t> threads;
+    pthread_mutex_t mtx;
+    pthread_cond_t cond_var;
+#else
+    vector<thread> threads;
+    mutex mtx;
+    condition_variable cond_var;
+#endif
+};
 
-    return model;
+ThreadPool::ThreadPool()
+    : nr_tasks(0), nr_running(0), generation(0), stopping(false),
+      nr_loop_threads(1)
+{
+#ifdef USE_PTHREADS
+    pthread_mutex_init(&mtx, NULL);
+    pthread_cond_init(&cond_var, NULL);
+#endif
 }
 
-mf_float calc_std_dev(mf_problem &prob)
+ThreadPool::~ThreadPool()
 {
-    mf_double avg = 0;
-#if defined USEOMP
-#pragma omp parallel for schedule(static) reduction(+: avg)
+    lock();
+    stopping = true;
+    notify_all();
+    unlock();
+#ifdef USE_PTHREADS
+    for(pthread_t &thread : threads)
+        pthread_join(thread, NULL);
+    pthread_mutex_destroy(&mtx);
+    pthread_cond_destroy(&cond_var);
+#else
+    for(thread &thread : threads)
+        thread.join();
 #endif
-    for(mf_long i = 0; i < prob.nnz; i++)
-        avg += prob.R[i].r;
-    avg /= prob.nnz;
+}
 
-    mf_double std_dev = 0;
-#if defined USEOMP
-#pragma omp parallel for schedule(static) reduction(+: std_dev)
-#endif
-    for(mf_long i = 0; i < prob.nnz; i++)
-        std_dev += (prob.R[i].r-avg)*(prob.R[i].r-avg);
-    std_dev = sqrt(std_dev/prob.nnz);
+#ifdef USE_PTHREADS
+void ThreadPool::lock() { pthread_mutex_lock(&mtx); }
+void ThreadPool::unlock() { pthread_mutex_unlock(&mtx); }
+void ThreadPool::wait() { pthread_cond_wait(&cond_var, &mtx); }
+void ThreadPool::notify_all() { pthread_cond_broadcast(&cond_var); }
 
-    return (mf_float)std_dev;
+void *ThreadPool::run(void *data)
+{
+    Start start = *(Start *)data;
+    delete (Start *)data;
+    start.pool->work(start.id, start.generation);
+    return nullptr;
 }
+#else
+void ThreadPool::lock() { mtx.lock(); }
+void ThreadPool::unlock() { mtx.unlock(); }
+void ThreadPool::notify_all() { cond_var.notify_all(); }
 
-#if defined USESSE
-inline void sg_update(
-    mf_float *p,
-    mf_float *q,
-    mf_float *pG,
-    mf_float *qG,
-    mf_int d_begin,
-    mf_int d_end,
-    __m128 &XMMeta,
-    __m128 &XMMlambda,
-    __m128 &XMMe,
-    __m128 &XMMrk,
-    bool do_nmf)
-{
-    __m128 XMMpG = _mm_load1_ps(pG);
-    __m128 XMMqG = _mm_load1_ps(qG);
-    __m128 XMMeta_p =
-        _mm_mul_ps(XMMeta, _mm_rsqrt_ps(XMMpG));
-    __m128 XMMeta_q =
-        _mm_mul_ps(XMMeta, _mm_rsqrt_ps(XMMqG));
-    __m128 XMMpG1 = _mm_setzero_ps();
-    __m128 XMMqG1 = _mm_setzero_ps();
-
-    for(mf_int d = d_begin; d < d_end; d += 4)
-    {
-        __m128 XMMp = _mm_load_ps(p+d);
-        __m128 XMMq = _mm_load_ps(q+d);
-
-        __m128 XMMpg = _mm_sub_ps(_mm_mul_ps(XMMlambda, XMMp),
-                       _mm_mul_ps(XMMe, XMMq));
-        __m128 XMMqg = _mm_sub_ps(_mm_mul_ps(XMMlambda, XMMq),
-                       _mm_mul_ps(XMMe, XMMp));
-
-        XMMpG1 = _mm_add_ps(XMMpG1, _mm_mul_ps(XMMpg, XMMpg));
-        XMMqG1 = _mm_add_ps(XMMqG1, _mm_mul_ps(XMMqg, XMMqg));
-
-        XMMp = _mm_sub_ps(XMMp, _mm_mul_ps(XMMeta_p, XMMpg));
-        XMMq = _mm_sub_ps(XMMq, _mm_mul_ps(XMMeta_q, XMMqg));
-
-        if(do_nmf)
-        {
-            XMMp = _mm_max_ps(XMMp, _mm_set1_ps(0));
-            XMMq = _mm_max_ps(XMMq, _mm_set1_ps(0));
-        }
+void ThreadPool::wait()
+{
+    unique_lock<mutex> lock(mtx, adopt_lock);
+    cond_var.wait(lock);
+    lock.release();
+}
+#endif
 
-        _mm_store_ps(p+d, XMMp);
-        _mm_store_ps(q+d, XMMq);
-    }
-
-    XMMpG1 = _mm_hadd_ps(XMMpG1, XMMpG1);
-    XMMpG1 = _mm_hadd_ps(XMMpG1, XMMpG1);
-    XMMqG1 = _mm_hadd_ps(XMMqG1, XMMqG1);
-    XMMqG1 = _mm_hadd_ps(XMMqG1, XMMqG1);
-
-    XMMpG = _mm_add_ps(XMMpG, _mm_mul_ps(XMMpG1, XMMrk));
-    XMMqG = _mm_add_ps(XMMqG, _mm_mul_ps(XMMqG1, XMMrk));
-
-    _mm_store_ss(pG, XMMpG);
-    _mm_store_ss(qG, XMMqG);
-}
-#elif defined USEAVX
-inline void sg_update(
-    mf_float *p,
-    mf_float *q,
-    mf_float *pG,
-    mf_float *qG,
-    mf_int d_begin,
-    mf_int d_end,
-    __m256 &XMMeta,
-    __m256 &XMMlambda,
-    __m256 &XMMe,
-    __m256 &XMMrk,
-    bool do_nmf)
-{
-    __m256 XMMpG = _mm256_broadcast_ss(pG);
-    __m256 XMMqG = _mm256_broadcast_ss(qG);
-    __m256 XMMeta_p =
-        _mm256_mul_ps(XMMeta, _mm256_rsqrt_ps(XMMpG));
-    __m256 XMMeta_q =
-        _mm256_mul_ps(XMMeta, _mm256_rsqrt_ps(XMMqG));
-    __m256 XMMpG1 = _mm256_setzero_ps();
-    __m256 XMMqG1 = _mm256_setzero_ps();
-
-    for(mf_int d = d_begin; d < d_end; d += 8)
-    {
-        __m256 XMMp = _mm256_load_ps(p+d);
-        __m256 XMMq = _mm256_load_ps(q+d);
-
-        __m256 XMMpg = _mm256_sub_ps(_mm256_mul_ps(XMMlambda, XMMp),
-                                  _mm256_mul_ps(XMMe, XMMq));
-        __m256 XMMqg = _mm256_sub_ps(_mm256_mul_ps(XMMlambda, XMMq),
-                                  _mm256_mul_ps(XMMe, XMMp));
-
-        XMMpG1 =
-            _mm256_add_ps(XMMpG1, _mm256_mul_ps(XMMpg, XMMpg));
-        XMMqG1 =
-            _mm256_add_ps(XMMqG1, _mm256_mul_ps(XMMqg, XMMqg));
-
-        XMMp = _mm256_sub_ps(XMMp, _mm256_mul_ps(XMMeta_p, XMMpg));
-        XMMq = _mm256_sub_ps(XMMq, _mm256_mul_ps(XMMeta_q, XMMqg));
-
-        if(do_nmf)
+void ThreadPool::start(mf_int nr_tasks, function<void(mf_int)> task)
+{
+    lock();
+    // New threads wait for the tasks after those of the last start()
+    while((mf_int)threads.size() < nr_tasks)
+    {
+        mf_int id = (mf_int)threads.size();
+#ifdef USE_PTHREADS
+        pthread_t thread;
+        Start *start = new Start{this, id, generation};
+        if(pthread_create(&thread, nullptr, run, start) != 0)
         {
-            XMMp = _mm256_max_ps(XMMp, _mm256_set1_ps(0));
-            XMMq = _mm256_max_ps(XMMq, _mm256_set1_ps(0));
+            delete start;
+            unlock();
+            throw runtime_error("creating new thread failed");
         }
-
-        _mm256_store_ps(p+d, XMMp);
-        _mm256_store_ps(q+d, XMMq);
+        threads.push_back(thread);
+#else
+        threads.emplace_back(&ThreadPool::work, this, id, generation);
+#endif
     }
-    XMMpG1 = _mm256_add_ps(XMMpG1, _mm256_permute2f128_ps(XMMpG1, XMMpG1, 1));
-    XMMpG1 = _mm256_hadd_ps(XMMpG1, XMMpG1);
-    XMMpG1 = _mm256_hadd_ps(XMMpG1, XMMpG1);
-
-    XMMqG1 = _mm256_add_ps(XMMqG1, _mm256_permute2f128_ps(XMMqG1, XMMqG1, 1));
-    XMMqG1 = _mm256_hadd_ps(XMMqG1, XMMqG1);
-    XMMqG1 = _mm256_hadd_ps(XMMqG1, XMMqG1);
-
-    XMMpG = _mm256_add_ps(XMMpG, _mm256_mul_ps(XMMpG1, XMMrk));
-    XMMqG = _mm256_add_ps(XMMqG, _mm256_mul_ps(XMMqG1, XMMrk));
-
-    _mm_store_ss(pG, _mm256_castps256_ps128(XMMpG));
-    _mm_store_ss(qG, _mm256_castps256_ps128(XMMqG));
+    this->task = task;
+    this->nr_tasks = nr_tasks;
+    nr_running = nr_tasks;
+    generation++;
+    notify_all();
+    unlock();
 }
-#else
 
-float qrsqrt(float x)
+void ThreadPool::join()
 {
-    float xhalf = 0.5f*x;
-    uint32_t i;
-    memcpy(&i, &x, sizeof(i));
-    i = 0x5f375a86 - (i>>1);
-    memcpy(&x, &i, sizeof(i));
-    x = x*(1.5f - xhalf*x*x);
-    return x;
+    lock();
+    while(nr_running > 0)
+        wait();
+    task = nullptr;
+    unlock();
 }
 
-inline void sg_update(
-    mf_float *p,
-    mf_float *q,
-    mf_float *pG,
-    mf_float *qG,
-    mf_int d_begin,
-    mf_int d_end,
-    mf_float eta,
-    mf_float lambda,
-    mf_float error,
-    mf_float rk,
-    bool do_nmf)
+void ThreadPool::work(mf_int id, mf_long generation)
 {
-    mf_float eta_p = eta*qrsqrt(*pG);
-    mf_float eta_q = eta*qrsqrt(*qG);
+    lock();
+    while(true)
+    {
+        while(!stopping && this->generation == generation)
+            wait();
+        if(stopping)
+            break;
+        generation = this->generation;
+        if(id >= nr_tasks)
+            continue;
+
+        unlock();
+        task(id);
+        lock();
+        if(--nr_running == 0)
+            notify_all();
+    }
+    unlock();
+}
 
-    mf_float pG1 = 0;
-    mf_float qG1 = 0;
+void ThreadPool::run(mf_int nr_threads, function<void(mf_int)> task)
+{
+    if(nr_threads <= 1)
+    {
+        task(0);
+        return;
+    }
 
-    for(mf_int d = d_begin; d < d_end; d++)
+    start(nr_threads-1, [&] (mf_int i) { task(i+1); });
+    try
+    {
+        task(0);
+    }
+    catch(...)
     {
-        mf_float gp = -error*q[d]+lambda*p[d];
-        mf_float gq = -error*p[d]+lambda*q[d];
+        join();
+        throw;
+    }
+    join();
+}
 
-        pG1 += gp*gp;
-        qG1 += gq*gq;
+ThreadPool& thread_pool()
+{
+    static ThreadPool pool;
+    return pool;
+}
 
-        p[d] -= eta_p*gp;
-        q[d] -= eta_q*gq;
+// Calls f(i) for i in [0, size) on the threads of the pool, which take
+// grain indices at a time
+template<typename F>
+void parallel_for(mf_long size, mf_long grain, F const &f)
+{
+    mf_int nr_threads = (mf_int)min((mf_long)thread_pool().get_nr_threads(),
+                                    (size+grain-1)/grain);
+    if(nr_threads <= 1)
+    {
+        for(mf_long i = 0; i < size; i++)
+            f(i);
+        return;
+    }
 
-        if(do_nmf)
+    atomic<mf_long> next(0);
+    thread_pool().run(nr_threads, [&] (mf_int)
+    {
+        mf_long begin;
+        while((begin = next.fetch_add(grain)) < size)
         {
-            p[d] = max(p[d], (mf_float)0.0);
-            q[d] = max(q[d], (mf_float)0.0);
+            mf_long end = min(begin+grain, size);
+            for(mf_long i = begin; i < end; i++)
+                f(i);
         }
-    }
+    });
+}
 
-    *pG += pG1*rk;
-    *qG += qG1*rk;
+// Sums f(i) for i in [0, size) in chunks of fixed size, added up in order,
+// so that the sum does not depend on the number of threads
+template<typename F>
+mf_double sum_in_chunks(mf_long size, F const &f)
+{
+    mf_long const chunk_size = 1 << 16;
+    mf_long nr_chunks = (size+chunk_size-1)/chunk_size;
+    vector<mf_double> sums(nr_chunks, 0);
+    parallel_for(nr_chunks, 1, [&] (mf_long chunk)
+    {
+        mf_long end = min((chunk+1)*chunk_size, size);
+        for(mf_long i = chunk*chunk_size; i < end; i++)
+            sums[chunk] += f(i);
+    });
+    return accumulate(sums.begin(), sums.end(), 0.0);
 }
-#endif
 
-void sg(vector<mf_node*> &ptrs, mf_model &model, Scheduler &sched,
-        mf_parameter param, bool &slow_only, mf_float *PG, mf_float *QG)
+// Where the threads of fpsg() run, and the data that they work on live,
+// with param.numa. Thread t of nr_threads is pinned to a CPU of node
+// t*nr_nodes/nr_threads. Row and column bin i of the grid belong to node
+// i*nr_nodes/nr_bins, which first touches the rows of P and Q in the bin
+// and the blocks in the row bin, so that the OS allocates their pages on
+// it, and whose threads the scheduler hands the blocks of the bin first.
+// Without param.numa, or on a single node, nothing is placed, and threads
+// are only pinned with param.numa.
+class NumaPlan
 {
-    mf_float * P = model.P;
-    mf_float * Q = model.Q;
+public:
+    NumaPlan() : enabled(false), nr_nodes(1), nr_bins(1), nr_threads(1) {}
 
-#if defined USESSE
-    __m128 XMMlambda = _mm_set1_ps(param.lambda);
-    __m128 XMMeta = _mm_set1_ps(param.eta);
-    __m128 XMMrk_slow = _mm_set1_ps(1.0/kALIGN);
-    __m128 XMMrk_fast = _mm_set1_ps(1.0/(model.k-kALIGN));
-    while(true)
+    NumaPlan(mf_parameter const &param)
+        : enabled(param.numa != 0),
+          nr_nodes(enabled ? topology.nr_nodes() : 1),
+          nr_bins(param.nr_bins),
+          nr_threads(param.nr_threads) {}
+
+    mf_int bin_node(mf_int bin) const
     {
-        mf_int block = sched.get_job();
-        __m128d XMMloss = _mm_setzero_pd();
-        for(mf_node *N = ptrs[block]; N != ptrs[block+1]; N++)
-        {
-            mf_float *p = P+(mf_long)N->u*model.k;
-            mf_float *q = Q+(mf_long)N->v*model.k;
-            mf_float *pG = PG+N->u*2;
-            mf_float *qG = QG+N->v*2;
-
-            __m128 XMMe = _mm_setzero_ps();
-            for(mf_int d = 0; d < model.k; d += 4)
-                XMMe = _mm_add_ps(XMMe, _mm_mul_ps(
-                       _mm_load_ps(p+d), _mm_load_ps(q+d)));
-            XMMe = _mm_hadd_ps(XMMe, XMMe);
-            XMMe = _mm_hadd_ps(XMMe, XMMe);
-
-            if (param.do_implicit) {
-                XMMe = _mm_sub_ps(_mm_set1_ps((N->r > 0) ? 1 : 0), XMMe);
-                XMMloss = _mm_add_pd(XMMloss,
-                    _mm_cvtps_pd(
-                        _mm_mul_ps(
-                            _mm_set1_ps(1 + param.alpha * N->r), 
-                            _mm_mul_ps(XMMe, XMMe)
-                        )
-                    )
-                );
-                XMMe = _mm_mul_ps(
-                    _mm_set1_ps(1 + param.alpha * N->r), 
-                    XMMe);
-            } else {
-                XMMe = _mm_sub_ps(_mm_set1_ps(N->r), XMMe);
-                XMMloss = _mm_add_pd(XMMloss,
-                    _mm_cvtps_pd(_mm_mul_ps(XMMe, XMMe)));
-            }
+        return (mf_int)((mf_long)bin*nr_nodes/nr_bins);
+    }
 
-            sg_update(p, q, pG, qG, 0, kALIGN, XMMeta, XMMlambda,
-                      XMMe, XMMrk_slow, param.do_nmf);
+    mf_int thread_node(mf_int thread) const
+    {
+        return (mf_int)((mf_long)thread*nr_nodes/nr_threads);
+    }
 
-            if(slow_only)
-                continue;
+    // Nodes of the bins and threads for the scheduler, empty if there is
+    // one node
+    vector<mf_int> bin_nodes() const
+    {
+        vector<mf_int> nodes;
+        for(mf_int bin = 0; nr_nodes > 1 && bin < nr_bins; bin++)
+            nodes.push_back(bin_node(bin));
+        return nodes;
+    }
+
+    vector<mf_int> thread_nodes() const
+    {
+        vector<mf_int> nodes;
+        for(mf_int thread = 0; nr_nodes > 1 && thread < nr_threads; thread++)
+            nodes.push_back(thread_node(thread));
+        return nodes;
+    }
+
+    // Pins the calling worker thread to its CPU
+    void pin(mf_int thread) const
+    {
+        if(!enabled)
+            return;
+        mf_int node = thread_node(thread);
+        mf_int first = (mf_int)(((mf_long)node*nr_threads+nr_nodes-1)/nr_nodes);
+        topology.pin(node, thread-first);
+    }
+
+    // Undoes pin(), before the thread goes back to the pool
+    void unpin() const
+    {
+        if(enabled)
+            topology.unpin();
+    }
+
+    // Touches the pages of size rows of row_bytes each at ptr, the rows of
+    // each bin from its node. The rows are written afterwards.
+    void place_rows(void *ptr, mf_int size, mf_long row_bytes) const
+    {
+        mf_int seg = (mf_int)ceil((double)size/nr_bins);
+        on_nodes([&] (mf_int node)
+        {
+            for(mf_int bin = 0; bin < nr_bins; bin++)
+            {
+                mf_long begin = min((mf_long)bin*seg, (mf_long)size);
+                mf_long end = min((mf_long)(bin+1)*seg, (mf_long)size);
+                if(bin_node(bin) == node)
+                    touch((char *)ptr+begin*row_bytes,
+                          (char *)ptr+end*row_bytes);
+            }
+        });
+    }
+
+    // Touches the pages of the grid blocks that start at ptr and whose
+    // bounds in elements of elem_bytes are offsets, the blocks of each row
+    // bin from its node
+    void place_blocks(void *ptr, vector<mf_long> const &offsets,
+                      mf_long elem_bytes) const
+    {
+        on_nodes([&] (mf_int node)
+        {
+            for(mf_int bin = 0; bin < nr_bins; bin++)
+                if(bin_node(bin) == node)
+                    touch((char *)ptr+offsets[bin*nr_bins]*elem_bytes,
+                          (char *)ptr+offsets[(bin+1)*nr_bins]*elem_bytes);
+        });
+    }
+
+private:
+    // Runs f(node) on a thread on each node, if there is more than one
+    template<typename F>
+    void on_nodes(F const &f) const
+    {
+        if(nr_nodes == 1)
+            return;
+
+        thread_pool().start(nr_nodes, [&] (mf_int node)
+        {
+            topology.pin(node, -1);
+            f(node);
+            topology.unpin();
+        });
+        thread_pool().join();
+    }
+
+    // Writes a zero into every page of [begin, end)
+    static void touch(char *begin, char *end)
+    {
+        mf_long const page_bytes = 4096;
+        for(char *ptr = begin; ptr < end;
+            ptr = (char *)(((uintptr_t)ptr/page_bytes+1)*page_bytes))
+            *(volatile char *)ptr = 0;
+    }
+
+    Reco::Topology topology;
+    bool enabled;
+    mf_int nr_nodes;
+    mf_int nr_bins;
+    mf_int nr_threads;
+};
+
+mf_model* init_model(mf_int m, mf_int n, mf_int k_real, mf_int k_aligned,
+                     NumaPlan const &plan)
+{
+    mf_model *model = new mf_model;
+    model->m = m;
+    model->n = n;
+    model->k = k_aligned;
+    model->P = nullptr;
+    model->Q = nullptr;
+    model->mapping = nullptr;
+
+    mf_float scale = sqrt(1.0/k_real);
+
+    try
+    {
+        model->P = malloc_aligned_float((mf_long)m*model->k);
+        model->Q = malloc_aligned_float((mf_long)n*model->k);
+    }
+    catch(bad_alloc const &e)
+    {
+        mf_destroy_model(&model);
+        throw;
+    }
+
+    plan.place_rows(model->P, m, model->k*sizeof(mf_float));
+    plan.place_rows(model->Q, n, model->k*sizeof(mf_float));
+
+    // Rows are drawn in chunks, each from its own stream, so that the
+    // model is the same whatever the number of threads
+    mf_int const chunk_rows = 1024;
+    auto init1 = [&] (mf_float *P, mf_int count, uint64_t seed)
+    {
+        mf_int nr_chunks = (count+chunk_rows-1)/chunk_rows;
+        parallel_for(nr_chunks, 1, [&] (mf_long chunk)
+        {
+            Reco::Rng rng(seed, chunk);
+            mf_int end = min(count, (mf_int)(chunk+1)*chunk_rows);
+            mf_float *ptr = P+chunk*chunk_rows*k_aligned;
+            for(mf_int i = (mf_int)chunk*chunk_rows; i < end; i++)
+            {
+                mf_long d = 0;
+                for(; d < k_real; d++, ptr++)
+                    *ptr = (mf_float)(rng.unif()*scale);
+                for(; d < k_aligned; d++, ptr++)
+                    *ptr = 0;
+            }
+        });
+    };
+
+    uint64_t seed_p = Reco::rand_seed();
+    uint64_t seed_q = Reco::rand_seed();
+    init1(model->P, m, seed_p);
+    init1(model->Q, n, seed_q);
+
+    return model;
+}
+
+mf_float calc_std_dev(mf_problem const &prob)
+{
+    mf_double avg = sum_in_chunks(prob.nnz, [&] (mf_long i)
+    {
+        return (mf_double)prob.R[i].r;
+    });
+    avg /= prob.nnz;
+
+    mf_double std_dev = sum_in_chunks(prob.nnz, [&] (mf_long i)
+    {
+        return (prob.R[i].r-avg)*(prob.R[i].r-avg);
+    });
+    std_dev = sqrt(std_dev/prob.nnz);
+
+    return (mf_float)std_dev;
+}
+
+float qrsqrt(float x)
+{
+    float xhalf = 0.5f*x;
+    uint32_t i;
+    memcpy(&i, &x, sizeof(i));
+    i = 0x5f375a86 - (i>>1);
+    memcpy(&x, &i, sizeof(i));
+    x = x*(1.5f - xhalf*x*x);
+    return x;
+}
+
+// Storage types of P and Q for training with reduced precision, holding
+// the raw 16 bits of a bfloat16 and an IEEE half value
+struct bf16 { uint16_t bits; };
+struct fp16 { uint16_t bits; };
+
+inline mf_float to_float(mf_float x)
+{
+    return x;
+}
+
+inline mf_float to_float(bf16 x)
+{
+    uint32_t i = (uint32_t)x.bits << 16;
+    mf_float f;
+    memcpy(&f, &i, sizeof(f));
+    return f;
+}
+
+inline mf_float to_float(fp16 x)
+{
+    uint32_t sign = (uint32_t)(x.bits & 0x8000) << 16;
+    uint32_t exp = (x.bits >> 10) & 0x1F;
+    uint32_t man = x.bits & 0x3FF;
+
+    uint32_t i;
+    if(exp == 0x1F)
+        i = sign | 0x7F800000 | (man << 13);
+    else if(exp != 0)
+        i = sign | ((exp+112) << 23) | (man << 13);
+    else if(man == 0)
+        i = sign;
+    else
+    {
+        // Subnormal half, normal float
+        exp = 113;
+        while(!(man & 0x400))
+        {
+            man <<= 1;
+            exp--;
+        }
+        i = sign | (exp << 23) | ((man & 0x3FF) << 13);
+    }
+
+    mf_float f;
+    memcpy(&f, &i, sizeof(f));
+    return f;
+}
+
+inline void from_float(mf_float f, mf_float &x)
+{
+    x = f;
+}
+
+// Rounds to the nearest bfloat16, ties to even
+inline void from_float(mf_float f, bf16 &x)
+{
+    uint32_t i;
+    memcpy(&i, &f, sizeof(i));
+    if((i & 0x7FFFFFFF) > 0x7F800000)
+        x.bits = (uint16_t)((i >> 16) | 0x40);
+    else
+        x.bits = (uint16_t)((i+0x7FFF+((i >> 16) & 1)) >> 16);
+}
+
+// Rounds to the nearest half, ties to even
+inline void from_float(mf_float f, fp16 &x)
+{
+    uint32_t i;
+    memcpy(&i, &f, sizeof(i));
+    uint32_t sign = (i >> 16) & 0x8000;
+    uint32_t abs = i & 0x7FFFFFFF;
+
+    if(abs > 0x7F800000)
+        x.bits = (uint16_t)(sign | 0x7E00);
+    else if(abs >= 0x477FF000)
+        x.bits = (uint16_t)(sign | 0x7C00);
+    else if(abs >= 0x38800000)
+        x.bits = (uint16_t)(sign | ((abs+0xFFF+((abs >> 13) & 1)-0x38000000) >> 13));
+    else if(abs < 0x33000000)
+        x.bits = (uint16_t)sign;
+    else
+    {
+        // Subnormal half
+        uint32_t shift = 126-(abs >> 23);
+        uint32_t man = (abs & 0x7FFFFF) | 0x800000;
+        uint32_t half = man >> shift;
+        uint32_t rest = man & ((1u << shift)-1);
+        uint32_t tie = 1u << (shift-1);
+        if(rest > tie || (rest == tie && (half & 1)))
+            half++;
+        x.bits = (uint16_t)(sign | half);
+    }
+}
+
+// The rows of P and Q as the kernels read them, k values of the storage
+// precision every row_bytes
+struct FactorRows
+{
+    mf_int m;
+    mf_int n;
+    mf_int k;
+    mf_int precision;
+    mf_long row_bytes;
+    void *P;
+    void *Q;
+};
+
+// P and Q of the model being trained. With reduced precision they are
+// narrowed to bf16 or fp16 rows of k values for the iterations, and the
+// float matrices of the model are released until widen() restores them.
+class Factors : public FactorRows
+{
+public:
+    Factors(mf_model &model, mf_int precision, NumaPlan const &plan);
+    ~Factors();
+
+    // Writes the factors back to the model as floats
+    void widen();
+
+private:
+    Factors(Factors const &);
+    Factors& operator=(Factors const &);
+
+    template<typename T>
+    void *narrow(mf_float *&src, mf_int rows, NumaPlan const &plan);
+
+    template<typename T>
+    mf_float *widen(void *&src, mf_int rows);
+
+    mf_model &model;
+};
+
+Factors::Factors(mf_model &model, mf_int precision, NumaPlan const &plan)
+    : FactorRows{model.m, model.n, model.k, precision, 0, model.P, model.Q},
+      model(model)
+{
+    if(precision == MF_BF16)
+    {
+        row_bytes = (mf_long)k*sizeof(bf16);
+        P = narrow<bf16>(model.P, m, plan);
+        Q = narrow<bf16>(model.Q, n, plan);
+    }
+    else if(precision == MF_FP16)
+    {
+        row_bytes = (mf_long)k*sizeof(fp16);
+        P = narrow<fp16>(model.P, m, plan);
+        Q = narrow<fp16>(model.Q, n, plan);
+    }
+    else
+    {
+        this->precision = MF_FP32;
+        row_bytes = (mf_long)k*sizeof(mf_float);
+    }
+}
+
+Factors::~Factors()
+{
+    if(precision != MF_FP32)
+    {
+        free_aligned_memory(P);
+        free_aligned_memory(Q);
+    }
+}
+
+void Factors::widen()
+{
+    if(precision == MF_BF16)
+    {
+        model.P = widen<bf16>(P, m);
+        model.Q = widen<bf16>(Q, n);
+    }
+    else if(precision == MF_FP16)
+    {
+        model.P = widen<fp16>(P, m);
+        model.Q = widen<fp16>(Q, n);
+    }
+    P = model.P;
+    Q = model.Q;
+    precision = MF_FP32;
+}
+
+template<typename T>
+void *Factors::narrow(mf_float *&src, mf_int rows, NumaPlan const &plan)
+{
+    mf_long size = (mf_long)rows*k;
+    T *dst = (T *)malloc_aligned_memory(size*sizeof(T));
+    plan.place_rows(dst, rows, k*sizeof(T));
+    parallel_for(size, 1 << 16, [&] (mf_long i)
+    {
+        from_float(src[i], dst[i]);
+    });
+    free_aligned_memory(src);
+    src = nullptr;
+    return dst;
+}
+
+template<typename T>
+mf_float *Factors::widen(void *&src, mf_int rows)
+{
+    mf_long size = (mf_long)rows*k;
+    mf_float *dst = malloc_aligned_float(size);
+    T const *ptr = (T const *)src;
+    parallel_for(size, 1 << 16, [&] (mf_long i)
+    {
+        dst[i] = to_float(ptr[i]);
+    });
+    free_aligned_memory(src);
+    src = nullptr;
+    return dst;
+}
+
+// A copy of the factors, taken by take() at the end of an iteration. The
+// rows are copied in chunks, which the threads that call help() meanwhile
+// share with the one in take(). Chunks are claimed in work, which holds
+// the number of the copy in the high half and the next chunk in the low
+// one, so that a thread still on a previous copy cannot claim any.
+class Snapshot : public FactorRows
+{
+public:
+    Snapshot(FactorRows const &factors);
+    ~Snapshot();
+
+    void take(FactorRows const &factors);
+    void help();
+
+private:
+    Snapshot(Snapshot const &);
+    Snapshot& operator=(Snapshot const &);
+
+    bool copy_chunk();
+
+    FactorRows const *source;
+    mf_long chunk_rows;
+    mf_long nr_p_chunks;
+    mf_long nr_chunks;
+    uint64_t nr_copies;
+    atomic<uint64_t> work;
+    atomic<mf_long> nr_copied;
+};
+
+Snapshot::Snapshot(FactorRows const &factors)
+    : FactorRows(factors),
+      source(nullptr),
+      chunk_rows(max((mf_long)(1 << 18)/factors.row_bytes, (mf_long)1)),
+      nr_p_chunks((factors.m+chunk_rows-1)/chunk_rows),
+      nr_chunks(nr_p_chunks+(factors.n+chunk_rows-1)/chunk_rows),
+      nr_copies(0),
+      work(nr_chunks),
+      nr_copied(0)
+{
+    P = nullptr;
+    Q = nullptr;
+    try
+    {
+        P = malloc_aligned_memory((mf_long)m*row_bytes);
+        Q = malloc_aligned_memory((mf_long)n*row_bytes);
+    }
+    catch(bad_alloc const &e)
+    {
+        free_aligned_memory(P);
+        throw;
+    }
+}
+
+Snapshot::~Snapshot()
+{
+    free_aligned_memory(P);
+    free_aligned_memory(Q);
+}
+
+void Snapshot::take(FactorRows const &factors)
+{
+    source = &factors;
+    nr_copied.store(0);
+    nr_copies++;
+    work.store(nr_copies << 32, memory_order_release);
+
+    while(copy_chunk());
+    while(nr_copied.load(memory_order_acquire) < nr_chunks)
+        yield_thread();
+}
+
+void Snapshot::help()
+{
+    bool copied = false;
+    while(copy_chunk())
+        copied = true;
+    if(!copied)
+        yield_thread();
+}
+
+// Copies the next chunk of the current copy, if any is left
+bool Snapshot::copy_chunk()
+{
+    uint64_t claim = work.load(memory_order_acquire);
+    do
+    {
+        if((mf_long)(claim & 0xffffffff) >= nr_chunks)
+            return false;
+    }
+    while(!work.compare_exchange_weak(claim, claim+1,
+                                      memory_order_acq_rel));
+
+    mf_long chunk = (mf_long)(claim & 0xffffffff);
+    bool is_p = chunk < nr_p_chunks;
+    mf_long begin = (is_p ? chunk : chunk-nr_p_chunks)*chunk_rows;
+    mf_long end = min(begin+chunk_rows, (mf_long)(is_p ? m : n));
+    char const *from = (char const *)(is_p ? source->P : source->Q);
+    char *to = (char *)(is_p ? P : Q);
+    memcpy(to+begin*row_bytes, from+begin*row_bytes,
+           (size_t)((end-begin)*row_bytes));
+    nr_copied.fetch_add(1, memory_order_release);
+    return true;
+}
+
+// The snapshot of the factors at the end of every iteration, to report
+// the progress of training while the threads go on. The thread that ends
+// an iteration takes the snapshot in push(), with the help of the others,
+// once the main thread is done with that of the iteration before through
+// front() and pop(). The threads only wait for the copy, and for the main
+// thread when it is an iteration behind.
+class SnapshotQueue
+{
+public:
+    SnapshotQueue(FactorRows const &factors);
+#ifdef USE_PTHREADS
+    ~SnapshotQueue();
+#endif
+    void push(mf_int iter, FactorRows const &factors, mf_double loss);
+    void help() { snapshot.help(); }
+    Snapshot const &front(mf_int iter, mf_double &loss);
+    void pop();
+
+private:
+    void lock();
+    void unlock();
+    void wait();
+    void notify_all();
+
+    Snapshot snapshot;
+    mf_double loss;
+    mf_int iter;
+    bool ready;
+#ifdef USE_PTHREADS
+    pthread_mutex_t mtx;
+    pthread_cond_t cond_var;
+#else
+    mutex mtx;
+    condition_variable cond_var;
+#endif
+};
+
+SnapshotQueue::SnapshotQueue(FactorRows const &factors)
+    : snapshot(factors), loss(0), iter(-1), ready(false)
+{
+#ifdef USE_PTHREADS
+    pthread_mutex_init(&mtx, NULL);
+    pthread_cond_init(&cond_var, NULL);
+#endif
+}
+
+#ifdef USE_PTHREADS
+SnapshotQueue::~SnapshotQueue()
+{
+    pthread_mutex_destroy(&mtx);
+    pthread_cond_destroy(&cond_var);
+}
+
+void SnapshotQueue::lock() { pthread_mutex_lock(&mtx); }
+void SnapshotQueue::unlock() { pthread_mutex_unlock(&mtx); }
+void SnapshotQueue::wait() { pthread_cond_wait(&cond_var, &mtx); }
+void SnapshotQueue::notify_all() { pthread_cond_broadcast(&cond_var); }
+#else
+void SnapshotQueue::lock() { mtx.lock(); }
+void SnapshotQueue::unlock() { mtx.unlock(); }
+void SnapshotQueue::notify_all() { cond_var.notify_all(); }
+
+void SnapshotQueue::wait()
+{
+    unique_lock<mutex> lock(mtx, adopt_lock);
+    cond_var.wait(lock);
+    lock.release();
+}
+#endif
+
+// The factors are copied outside the lock, once the main thread is done
+// with the snapshot of the iteration before
+void SnapshotQueue::push(mf_int iter, FactorRows const &factors,
+                         mf_double loss)
+{
+    lock();
+    while(ready)
+        wait();
+    unlock();
+
+    snapshot.take(factors);
+
+    lock();
+    this->iter = iter;
+    this->loss = loss;
+    ready = true;
+    notify_all();
+    unlock();
+}
+
+Snapshot const &SnapshotQueue::front(mf_int iter, mf_double &loss)
+{
+    lock();
+    while(!ready || this->iter != iter)
+        wait();
+    loss = this->loss;
+    unlock();
+    return snapshot;
+}
+
+void SnapshotQueue::pop()
+{
+    lock();
+    ready = false;
+    notify_all();
+    unlock();
+}
+
+// A rating of a grid block in 6 bytes: the row and column as offsets from
+// the first row and column of the block, and the index of the rating in
+// the table of distinct rating values
+struct PackedNode
+{
+    // Left uninitialized, so that the pages of the grid are first touched
+    // by NumaPlan::place_blocks()
+    PackedNode() {}
+
+    uint16_t u;
+    uint16_t v;
+    uint16_t r;
+};
+
+mf_int const kMaxPackedIndex = 1 << 16;
+
+// The nr_bins*nr_bins blocks of the training set, block (i, j) holding the
+// ratings of rows [i*seg_p, (i+1)*seg_p) and columns [j*seg_q, (j+1)*seg_q).
+// In memory the blocks are packed when possible, and ptrs is empty; on
+// disk, or when a block spans too many rows or columns or there are too
+// many distinct ratings, the blocks are runs of mf_node bounded by ptrs.
+struct Grid
+{
+    mf_int nr_bins;
+    mf_int seg_p;
+    mf_int seg_q;
+    vector<mf_node*> ptrs;
+    vector<PackedNode> nodes;
+    vector<mf_long> offsets;  // bounds of the packed blocks in nodes
+    vector<mf_float> values;  // scaled rating of each rating index
+
+    bool packed() const { return ptrs.empty(); }
+    mf_long size(mf_int block) const
+    {
+        return packed() ? offsets[block+1]-offsets[block] :
+                          ptrs[block+1]-ptrs[block];
+    }
+};
+
+// The ratings of one block as read by sg(), for either node layout
+template<typename Node>
+struct BlockNodes;
+
+template<>
+struct BlockNodes<mf_node>
+{
+    BlockNodes(Grid const &grid, mf_int block)
+        : begin(grid.ptrs[block]), end(grid.ptrs[block+1]) {}
+
+    mf_int u(mf_node const &N) const { return N.u; }
+    mf_int v(mf_node const &N) const { return N.v; }
+    mf_float r(mf_node const &N) const { return N.r; }
+
+    mf_node const *begin;
+    mf_node const *end;
+};
+
+template<>
+struct BlockNodes<PackedNode>
+{
+    BlockNodes(Grid const &grid, mf_int block)
+        : begin(grid.nodes.data()+grid.offsets[block]),
+          end(grid.nodes.data()+grid.offsets[block+1]),
+          u0(block/grid.nr_bins*grid.seg_p),
+          v0(block%grid.nr_bins*grid.seg_q),
+          values(grid.values.data()) {}
+
+    mf_int u(PackedNode const &N) const { return u0+N.u; }
+    mf_int v(PackedNode const &N) const { return v0+N.v; }
+    mf_float r(PackedNode const &N) const { return values[N.r]; }
+
+    PackedNode const *begin;
+    PackedNode const *end;
+    mf_int u0;
+    mf_int v0;
+    mf_float const *values;
+};
+
+// Asks the OS to start reading a block of an on-disk problem, so that it
+// is in memory by the time a thread picks it up
+inline void prefetch_block(
+    Reco::MappedFile const &block_file,
+    vector<mf_node*> const &ptrs,
+    mf_int block)
+{
+    if(block >= 0)
+        block_file.prefetch(ptrs[block], ptrs[block+1]);
+}
+
+// Asks for the cache lines of a row that the SGD loop will update soon
+inline void prefetch_row(void const *row, mf_long bytes)
+{
+#if defined __GNUC__
+    uintptr_t first = (uintptr_t)row/kCacheLineByte;
+    uintptr_t last = ((uintptr_t)row+bytes-1)/kCacheLineByte;
+    for(uintptr_t line = first; line <= last; line++)
+        __builtin_prefetch((void const *)(line*kCacheLineByte), 1);
+#endif
+}
+
+// Number of ratings ahead of the current one whose rows are prefetched,
+// if not set. The time spent on a rating grows with k, so smaller rows
+// need a longer lookahead to cover the latency of a cache miss.
+inline mf_int default_prefetch(mf_int k)
+{
+    return max(8, min(32, 2048/k));
+}
+
+// The helpers of the kernels must be inlined into sg(), so that they see
+// its constant dimension and mode
+#if defined __GNUC__
+  #define RECO_INLINE inline __attribute__((always_inline))
+#else
+  #define RECO_INLINE inline
+#endif
+
+// The SGD loop of one thread, see sg() in mf-kernels.h
+typedef void (*SgKernel)(Grid const &grid, Factors &factors,
+                         Scheduler &sched, mf_parameter param,
+                         mf_float *PG, mf_float *QG,
+                         Reco::MappedFile const *block_file,
+                         mf_int thread);
+
+// The kernels built for one instruction set. Every variant is compiled
+// into the package, and kernels() picks one at run time.
+struct Kernels
+{
+    char const *name;
+    // Returns the SGD loop specialized for the layout of the grid, the
+    // storage precision and the training mode and, for common dimensions,
+    // for the aligned dimension k
+    SgKernel (*select_sg)(bool packed, mf_int k, mf_int precision,
+                          bool do_implicit, bool do_nmf);
+    // Dot products and squared norms of aligned rows, indexed by the
+    // storage precision
+    mf_float (*inner_product[3])(void const *p, void const *q, mf_int k);
+    mf_float (*sq_norm[3])(void const *p, mf_int k);
+    // Dot product and squared norm of rows of any length and alignment,
+    // and the dot products of p with n consecutive rows of k floats
+    mf_float (*dot_product)(mf_float const *p, mf_float const *q, mf_int k);
+    mf_float (*squared_norm)(mf_float const *p, mf_int k);
+    void (*dot_rows)(mf_float const *p, mf_float const *Q, mf_int n,
+                     mf_int k, mf_float *products);
+    // Dot product of rows of k signed bytes, for int8 models
+    mf_int (*dot_int8)(signed char const *p, signed char const *q, mf_int k);
+};
+
+// Portable kernels on single floats, for CPUs without a variant below
+namespace generic
+{
+
+#define RECO_TARGET
+
+struct Ops
+{
+    typedef mf_float V;
+    struct Mask {};
+    static mf_int const width = 1;
+
+    static Mask all() { return Mask(); }
+    static Mask first(mf_int) { return Mask(); }
+    static V zero() { return 0; }
+    static V set1(mf_float a) { return a; }
+    template<typename T>
+    static V load(T const *p, Mask) { return to_float(*p); }
+    static V loadu(mf_float const *p) { return *p; }
+    template<typename T>
+    static void store(T *p, V v, Mask) { from_float(v, *p); }
+    static V add(V a, V b) { return a+b; }
+    static V sub(V a, V b) { return a-b; }
+    static V mul(V a, V b) { return a*b; }
+    static V max(V a, V b) { return std::max(a, b); }
+    static V fmadd(V a, V b, V c) { return a*b+c; }
+    static V fnmadd(V a, V b, V c) { return c-a*b; }
+    static V rsqrt(V a) { return qrsqrt(a); }
+    static V reduce(V a) { return a; }
+    static mf_float lane0(V a) { return a; }
+};
+
+#include "mf-kernels.h"
+
+#undef RECO_TARGET
+
+mf_int dot_int8(signed char const *p, signed char const *q, mf_int k)
+{
+    mf_int sum[4] = {0, 0, 0, 0};
+    mf_int d = 0;
+    for(; d+4 <= k; d += 4)
+    {
+        sum[0] += p[d]*q[d];
+        sum[1] += p[d+1]*q[d+1];
+        sum[2] += p[d+2]*q[d+2];
+        sum[3] += p[d+3]*q[d+3];
+    }
+    for(; d < k; d++)
+        sum[0] += p[d]*q[d];
+    return (sum[0]+sum[1])+(sum[2]+sum[3]);
+}
+
+Kernels const table = {"generic", select_sg,
+                       {inner_product<mf_float>, inner_product<bf16>,
+                        inner_product<fp16>},
+                       {sq_norm<mf_float>, sq_norm<bf16>, sq_norm<fp16>},
+                       dot_product, squared_norm, dot_rows,
+                       dot_int8};
+
+} // namespace generic
+
+#if defined RECO_X86_SIMD
+
+namespace sse
+{
+
+#define RECO_TARGET __attribute__((target("sse3")))
+
+struct Ops
+{
+    typedef __m128 V;
+    struct Mask {};
+    static mf_int const width = 4;
+
+    static Mask all() { return Mask(); }
+    static Mask first(mf_int) { return Mask(); }
+    RECO_TARGET static V zero() { return _mm_setzero_ps(); }
+    RECO_TARGET static V set1(mf_float a) { return _mm_set1_ps(a); }
+    RECO_TARGET static V load(mf_float const *p, Mask)
+    {
+        return _mm_load_ps(p);
+    }
+    RECO_TARGET static V loadu(mf_float const *p) { return _mm_loadu_ps(p); }
+    RECO_TARGET static void store(mf_float *p, V v, Mask)
+    {
+        _mm_store_ps(p, v);
+    }
+    // SSE3 has no conversions for 16-bit floats
+    template<typename T>
+    RECO_TARGET static V load(T const *p, Mask)
+    {
+        return _mm_setr_ps(to_float(p[0]), to_float(p[1]),
+                           to_float(p[2]), to_float(p[3]));
+    }
+    template<typename T>
+    RECO_TARGET static void store(T *p, V v, Mask)
+    {
+        mf_float f[4];
+        _mm_storeu_ps(f, v);
+        for(mf_int i = 0; i < 4; i++)
+            from_float(f[i], p[i]);
+    }
+    RECO_TARGET static V add(V a, V b) { return _mm_add_ps(a, b); }
+    RECO_TARGET static V sub(V a, V b) { return _mm_sub_ps(a, b); }
+    RECO_TARGET static V mul(V a, V b) { return _mm_mul_ps(a, b); }
+    RECO_TARGET static V max(V a, V b) { return _mm_max_ps(a, b); }
+    RECO_TARGET static V fmadd(V a, V b, V c)
+    {
+        return _mm_add_ps(_mm_mul_ps(a, b), c);
+    }
+    RECO_TARGET static V fnmadd(V a, V b, V c)
+    {
+        return _mm_sub_ps(c, _mm_mul_ps(a, b));
+    }
+    RECO_TARGET static V rsqrt(V a) { return _mm_rsqrt_ps(a); }
+    RECO_TARGET static V reduce(V a)
+    {
+        a = _mm_add_ps(a, _mm_shuffle_ps(a, a, _MM_SHUFFLE(1, 0, 3, 2)));
+        return _mm_add_ps(a, _mm_shuffle_ps(a, a, _MM_SHUFFLE(2, 3, 0, 1)));
+    }
+    RECO_TARGET static mf_float lane0(V a) { return _mm_cvtss_f32(a); }
+};
 
-            pG++;
-            qG++;
-            sg_update(p, q, pG, qG, kALIGN, model.k, XMMeta, XMMlambda,
-                      XMMe, XMMrk_fast, param.do_nmf);
-        }
-        mf_double loss;
-        _mm_store_sd(&loss, XMMloss);
-        sched.put_job(block, loss);
-        if(sched.is_terminated())
-            break;
+#include "mf-kernels.h"
+
+// SSE2 has no sign extension of bytes, so each byte is unpacked into
+// the upper half of a 16-bit lane and shifted down
+RECO_TARGET mf_int dot_int8(signed char const *p, signed char const *q,
+                            mf_int k)
+{
+    __m128i sum = _mm_setzero_si128();
+    mf_int d = 0;
+    for(; d+16 <= k; d += 16)
+    {
+        __m128i a = _mm_loadu_si128((__m128i const *)(p+d));
+        __m128i b = _mm_loadu_si128((__m128i const *)(q+d));
+        sum = _mm_add_epi32(sum, _mm_madd_epi16(
+            _mm_srai_epi16(_mm_unpacklo_epi8(a, a), 8),
+            _mm_srai_epi16(_mm_unpacklo_epi8(b, b), 8)));
+        sum = _mm_add_epi32(sum, _mm_madd_epi16(
+            _mm_srai_epi16(_mm_unpackhi_epi8(a, a), 8),
+            _mm_srai_epi16(_mm_unpackhi_epi8(b, b), 8)));
     }
-#elif defined USEAVX
-    __m256 XMMlambda = _mm256_set1_ps(param.lambda);
-    __m256 XMMeta = _mm256_set1_ps(param.eta);
-    __m256 XMMrk_slow = _mm256_set1_ps(1.0/kALIGN);
-    __m256 XMMrk_fast = _mm256_set1_ps(1.0/(model.k-kALIGN));
-    while(true)
+    sum = _mm_add_epi32(sum, _mm_shuffle_epi32(sum, _MM_SHUFFLE(1, 0, 3, 2)));
+    sum = _mm_add_epi32(sum, _mm_shuffle_epi32(sum, _MM_SHUFFLE(2, 3, 0, 1)));
+    mf_int total = _mm_cvtsi128_si32(sum);
+    for(; d < k; d++)
+        total += p[d]*q[d];
+    return total;
+}
+
+#undef RECO_TARGET
+
+Kernels const table = {"sse", select_sg,
+                       {inner_product<mf_float>, inner_product<bf16>,
+                        inner_product<fp16>},
+                       {sq_norm<mf_float>, sq_norm<bf16>, sq_norm<fp16>},
+                       dot_product, squared_norm, dot_rows,
+                       dot_int8};
+
+} // namespace sse
+
+#if defined RECO_X86_WIDE
+
+namespace avx2
+{
+
+#define RECO_TARGET __attribute__((target("avx2,fma,f16c")))
+
+struct Ops
+{
+    typedef __m256 V;
+    struct Mask {};
+    static mf_int const width = 8;
+
+    static Mask all() { return Mask(); }
+    static Mask first(mf_int) { return Mask(); }
+    RECO_TARGET static V zero() { return _mm256_setzero_ps(); }
+    RECO_TARGET static V set1(mf_float a) { return _mm256_set1_ps(a); }
+    RECO_TARGET static V load(mf_float const *p, Mask)
     {
-        mf_int block = sched.get_job();
-        __m128d XMMloss = _mm_setzero_pd();
-        for(mf_node *N = ptrs[block]; N != ptrs[block+1]; N++)
-        {
-            mf_float *p = P+(mf_long)N->u*model.k;
-            mf_float *q = Q+(mf_long)N->v*model.k;
-            mf_float *pG = PG+N->u*2;
-            mf_float *qG = QG+N->v*2;
-
-            __m256 XMMe = _mm256_setzero_ps();
-            for(mf_int d = 0; d < model.k; d += 8)
-                XMMe = _mm256_add_ps(XMMe, _mm256_mul_ps(
-                       _mm256_load_ps(p+d), _mm256_load_ps(q+d)));
-            XMMe = _mm256_add_ps(XMMe, _mm256_permute2f128_ps(XMMe, XMMe, 1));
-            XMMe = _mm256_hadd_ps(XMMe, XMMe);
-            XMMe = _mm256_hadd_ps(XMMe, XMMe);
-
-            if (param.do_implicit) {
-                XMMe = _mm256_sub_ps(_mm256_broadcast_ss((&N->r > 0) ? 1 : 0), XMMe);
-                XMMloss = _mm_add_pd(XMMloss,
-                    _mm_cvtps_pd(
-                        _mm256_castps256_ps128(
-                            _mm256_mul_ps(
-                                _mm256_set1_ps(1 + param.alpha * N->r),
-                                _mm256_mul_ps(XMMe, XMMe)
-                            )
-                        )
-                    )
-                );
-                XMMe = _mm256_mul_ps(
-                    _mm256_set1_ps(1 + param.alpha * N->r), 
-                    XMMe);
-            } else {
-                XMMe = _mm256_sub_ps(_mm256_broadcast_ss(&N->r), XMMe);
-                XMMloss = _mm_add_pd(XMMloss,
-                    _mm_cvtps_pd(_mm256_castps256_ps128(
-                        _mm256_mul_ps(XMMe, XMMe))));                
-            }
+        return _mm256_load_ps(p);
+    }
+    RECO_TARGET static V loadu(mf_float const *p)
+    {
+        return _mm256_loadu_ps(p);
+    }
+    RECO_TARGET static void store(mf_float *p, V v, Mask)
+    {
+        _mm256_store_ps(p, v);
+    }
+    RECO_TARGET static V load(bf16 const *p, Mask)
+    {
+        __m128i h = _mm_loadu_si128((__m128i const *)p);
+        return _mm256_castsi256_ps(
+            _mm256_slli_epi32(_mm256_cvtepu16_epi32(h), 16));
+    }
+    RECO_TARGET static void store(bf16 *p, V v, Mask)
+    {
+        // Round to nearest even, then pack the upper halves
+        __m256i i = _mm256_castps_si256(v);
+        __m256i odd = _mm256_and_si256(_mm256_srli_epi32(i, 16),
+                                       _mm256_set1_epi32(1));
+        i = _mm256_add_epi32(i, _mm256_add_epi32(odd,
+                                                 _mm256_set1_epi32(0x7FFF)));
+        i = _mm256_srli_epi32(i, 16);
+        i = _mm256_permute4x64_epi64(_mm256_packus_epi32(i, i), 0xD8);
+        _mm_storeu_si128((__m128i *)p, _mm256_castsi256_si128(i));
+    }
+    RECO_TARGET static V load(fp16 const *p, Mask)
+    {
+        return _mm256_cvtph_ps(_mm_loadu_si128((__m128i const *)p));
+    }
+    RECO_TARGET static void store(fp16 *p, V v, Mask)
+    {
+        _mm_storeu_si128((__m128i *)p,
+                         _mm256_cvtps_ph(v, _MM_FROUND_TO_NEAREST_INT));
+    }
+    RECO_TARGET static V add(V a, V b) { return _mm256_add_ps(a, b); }
+    RECO_TARGET static V sub(V a, V b) { return _mm256_sub_ps(a, b); }
+    RECO_TARGET static V mul(V a, V b) { return _mm256_mul_ps(a, b); }
+    RECO_TARGET static V max(V a, V b) { return _mm256_max_ps(a, b); }
+    RECO_TARGET static V fmadd(V a, V b, V c)
+    {
+        return _mm256_fmadd_ps(a, b, c);
+    }
+    RECO_TARGET static V fnmadd(V a, V b, V c)
+    {
+        return _mm256_fnmadd_ps(a, b, c);
+    }
+    RECO_TARGET static V rsqrt(V a) { return _mm256_rsqrt_ps(a); }
+    RECO_TARGET static V reduce(V a)
+    {
+        a = _mm256_add_ps(a, _mm256_permute2f128_ps(a, a, 1));
+        a = _mm256_add_ps(a, _mm256_shuffle_ps(a, a, _MM_SHUFFLE(1, 0, 3, 2)));
+        return _mm256_add_ps(a, _mm256_shuffle_ps(a, a, _MM_SHUFFLE(2, 3, 0, 1)));
+    }
+    RECO_TARGET static mf_float lane0(V a)
+    {
+        return _mm_cvtss_f32(_mm256_castps256_ps128(a));
+    }
+};
 
-            sg_update(p, q, pG, qG, 0, kALIGN, XMMeta, XMMlambda,
-                      XMMe, XMMrk_slow, param.do_nmf);
+#include "mf-kernels.h"
 
-            if(slow_only)
-                continue;
+RECO_TARGET mf_int dot_int8(signed char const *p, signed char const *q,
+                            mf_int k)
+{
+    __m256i sum0 = _mm256_setzero_si256();
+    __m256i sum1 = _mm256_setzero_si256();
+    mf_int d = 0;
+    for(; d+32 <= k; d += 32)
+    {
+        __m256i a0 = _mm256_cvtepi8_epi16(_mm_loadu_si128((__m128i const *)(p+d)));
+        __m256i b0 = _mm256_cvtepi8_epi16(_mm_loadu_si128((__m128i const *)(q+d)));
+        __m256i a1 = _mm256_cvtepi8_epi16(_mm_loadu_si128((__m128i const *)(p+d+16)));
+        __m256i b1 = _mm256_cvtepi8_epi16(_mm_loadu_si128((__m128i const *)(q+d+16)));
+        sum0 = _mm256_add_epi32(sum0, _mm256_madd_epi16(a0, b0));
+        sum1 = _mm256_add_epi32(sum1, _mm256_madd_epi16(a1, b1));
+    }
+    if(d+16 <= k)
+    {
+        __m256i a = _mm256_cvtepi8_epi16(_mm_loadu_si128((__m128i const *)(p+d)));
+        __m256i b = _mm256_cvtepi8_epi16(_mm_loadu_si128((__m128i const *)(q+d)));
+        sum0 = _mm256_add_epi32(sum0, _mm256_madd_epi16(a, b));
+        d += 16;
+    }
+    sum0 = _mm256_add_epi32(sum0, sum1);
+    __m128i sum = _mm_add_epi32(_mm256_castsi256_si128(sum0),
+                                _mm256_extracti128_si256(sum0, 1));
+    sum = _mm_add_epi32(sum, _mm_shuffle_epi32(sum, _MM_SHUFFLE(1, 0, 3, 2)));
+    sum = _mm_add_epi32(sum, _mm_shuffle_epi32(sum, _MM_SHUFFLE(2, 3, 0, 1)));
+    mf_int total = _mm_cvtsi128_si32(sum);
+    for(; d < k; d++)
+        total += p[d]*q[d];
+    return total;
+}
 
-            pG++;
-            qG++;
-            sg_update(p, q, pG, qG, kALIGN, model.k, XMMeta, XMMlambda,
-                      XMMe, XMMrk_fast, param.do_nmf);
-        }
-        mf_double loss;
-        _mm_store_sd(&loss, XMMloss);
-        sched.put_job(block, loss);
-        if(sched.is_terminated())
-            break;
+#undef RECO_TARGET
+
+Kernels const table = {"avx2", select_sg,
+                       {inner_product<mf_float>, inner_product<bf16>,
+                        inner_product<fp16>},
+                       {sq_norm<mf_float>, sq_norm<bf16>, sq_norm<fp16>},
+                       dot_product, squared_norm, dot_rows,
+                       dot_int8};
+
+} // namespace avx2
+
+namespace avx512
+{
+
+#define RECO_TARGET __attribute__((target("avx512f,avx2,fma,f16c")))
+#define RECO_FUSED_ROW_UPDATE
+#define RECO_MASKED_TAIL
+
+// Rows are only guaranteed to be aligned to kALIGNByte, half a vector,
+// so every access is unaligned, and a row of 8*odd floats ends with a
+// masked half vector
+struct Ops
+{
+    typedef __m512 V;
+    typedef __mmask16 Mask;
+    static mf_int const width = 16;
+
+    static Mask all() { return 0xFFFF; }
+    static Mask first(mf_int n) { return (Mask)((1u << n)-1); }
+    RECO_TARGET static V zero() { return _mm512_setzero_ps(); }
+    RECO_TARGET static V set1(mf_float a) { return _mm512_set1_ps(a); }
+    RECO_TARGET static V load(mf_float const *p, Mask mask)
+    {
+        return _mm512_maskz_loadu_ps(mask, p);
     }
-#else
-    mf_float rk_slow = 1.0/kALIGN;
-    mf_float rk_fast = 1.0/(model.k-kALIGN);
-    while(true)
+    RECO_TARGET static V loadu(mf_float const *p)
     {
-        mf_int block = sched.get_job();
-        mf_double loss = 0;
-        mf_int pref;
-        mf_int conf;
-        for(mf_node *N = ptrs[block]; N != ptrs[block+1]; N++)
-        {
-            mf_float *p = P+(mf_long)N->u*model.k;
-            mf_float *q = Q+(mf_long)N->v*model.k;
-            mf_float *pG = PG+N->u*2;
-            mf_float *qG = QG+N->v*2;
-
-            mf_float error;
-            if (param.do_implicit) {
-                pref = (N->r>0) ? 1 : 0;
-                conf = 1+param.alpha*N->r;
-            } else {
-                pref  = N->r;
-                conf = 1;
-            }
+        return _mm512_loadu_ps(p);
+    }
+    RECO_TARGET static void store(mf_float *p, V v, Mask mask)
+    {
+        _mm512_mask_storeu_ps(p, mask, v);
+    }
+    // 16-bit rows are read and written a whole or a half vector at a time,
+    // as partial vectors are always kALIGN lanes
+    RECO_TARGET static __m256i load16(void const *p, Mask mask)
+    {
+        if(mask == all())
+            return _mm256_loadu_si256((__m256i const *)p);
+        return _mm256_castsi128_si256(_mm_loadu_si128((__m128i const *)p));
+    }
+    RECO_TARGET static void store16(void *p, __m256i h, Mask mask)
+    {
+        if(mask == all())
+            _mm256_storeu_si256((__m256i *)p, h);
+        else
+            _mm_storeu_si128((__m128i *)p, _mm256_castsi256_si128(h));
+    }
+    RECO_TARGET static V load(bf16 const *p, Mask mask)
+    {
+        __m512i i = _mm512_cvtepu16_epi32(load16(p, mask));
+        return _mm512_maskz_mov_ps(mask,
+                                   _mm512_castsi512_ps(_mm512_slli_epi32(i, 16)));
+    }
+    RECO_TARGET static void store(bf16 *p, V v, Mask mask)
+    {
+        __m512i i = _mm512_castps_si512(v);
+        __m512i odd = _mm512_and_si512(_mm512_srli_epi32(i, 16),
+                                       _mm512_set1_epi32(1));
+        i = _mm512_add_epi32(i, _mm512_add_epi32(odd,
+                                                 _mm512_set1_epi32(0x7FFF)));
+        store16(p, _mm512_cvtepi32_epi16(_mm512_srli_epi32(i, 16)), mask);
+    }
+    RECO_TARGET static V load(fp16 const *p, Mask mask)
+    {
+        return _mm512_maskz_mov_ps(mask, _mm512_cvtph_ps(load16(p, mask)));
+    }
+    RECO_TARGET static void store(fp16 *p, V v, Mask mask)
+    {
+        store16(p, _mm512_cvtps_ph(v, _MM_FROUND_TO_NEAREST_INT), mask);
+    }
+    RECO_TARGET static V add(V a, V b) { return _mm512_add_ps(a, b); }
+    RECO_TARGET static V sub(V a, V b) { return _mm512_sub_ps(a, b); }
+    RECO_TARGET static V mul(V a, V b) { return _mm512_mul_ps(a, b); }
+    RECO_TARGET static V max(V a, V b) { return _mm512_max_ps(a, b); }
+    RECO_TARGET static V blend(Mask mask, V a, V b)
+    {
+        return _mm512_mask_blend_ps(mask, b, a);
+    }
+    RECO_TARGET static V fmadd(V a, V b, V c)
+    {
+        return _mm512_fmadd_ps(a, b, c);
+    }
+    RECO_TARGET static V fnmadd(V a, V b, V c)
+    {
+        return _mm512_fnmadd_ps(a, b, c);
+    }
+    RECO_TARGET static V rsqrt(V a) { return _mm512_rsqrt14_ps(a); }
+    RECO_TARGET static V reduce(V a)
+    {
+        a = _mm512_add_ps(a, _mm512_shuffle_f32x4(a, a, _MM_SHUFFLE(1, 0, 3, 2)));
+        a = _mm512_add_ps(a, _mm512_shuffle_f32x4(a, a, _MM_SHUFFLE(2, 3, 0, 1)));
+        a = _mm512_add_ps(a, _mm512_shuffle_ps(a, a, _MM_SHUFFLE(1, 0, 3, 2)));
+        return _mm512_add_ps(a, _mm512_shuffle_ps(a, a, _MM_SHUFFLE(2, 3, 0, 1)));
+    }
+    RECO_TARGET static mf_float lane0(V a)
+    {
+        return _mm_cvtss_f32(_mm512_castps512_ps128(a));
+    }
+};
 
-            error = pref;
-            for(mf_int d = 0; d < model.k; d++)
-                error -= p[d]*q[d];
+#include "mf-kernels.h"
 
-            loss += conf*error*error;
+#undef RECO_MASKED_TAIL
+#undef RECO_FUSED_ROW_UPDATE
+#undef RECO_TARGET
 
-            if (param.do_implicit)
-                error *= conf;
+#if defined RECO_X86_VNNI
+// VNNI sums the products of unsigned and signed bytes in one instruction.
+// Flipping the sign bit of p adds 128 to each of its bytes, so the excess
+// 128*sum(q) is accumulated alongside and subtracted at the end.
+__attribute__((target("avx512f,avx512bw,avx512vnni")))
+mf_int dot_int8_vnni(signed char const *p, signed char const *q, mf_int k)
+{
+    __m512i const bias = _mm512_set1_epi8((char)0x80);
+    __m512i sum = _mm512_setzero_si512();
+    __m512i excess = _mm512_setzero_si512();
+    for(mf_int d = 0; d < k; d += 64)
+    {
+        __mmask64 mask = k-d >= 64 ? ~(__mmask64)0 :
+                                     ((__mmask64)1 << (k-d))-1;
+        __m512i a = _mm512_maskz_loadu_epi8(mask, p+d);
+        __m512i b = _mm512_maskz_loadu_epi8(mask, q+d);
+        sum = _mm512_dpbusd_epi32(sum, _mm512_xor_si512(a, bias), b);
+        excess = _mm512_dpbusd_epi32(excess, bias, b);
+    }
+    return _mm512_reduce_add_epi32(_mm512_sub_epi32(sum, excess));
+}
+#endif
 
-            sg_update(p, q, pG, qG, 0, kALIGN, param.eta,
-                      param.lambda, error, rk_slow, param.do_nmf);
+// Bytes need AVX512BW, which not every AVX-512 CPU has, so the int8
+// kernel is that of AVX2 unless VNNI is found
+Kernels const table = {"avx512", select_sg,
+                       {inner_product<mf_float>, inner_product<bf16>,
+                        inner_product<fp16>},
+                       {sq_norm<mf_float>, sq_norm<bf16>, sq_norm<fp16>},
+                       dot_product, squared_norm, dot_rows,
+                       avx2::dot_int8};
 
-            if(slow_only)
-                continue;
+} // namespace avx512
 
-            pG++;
-            qG++;
+#endif // RECO_X86_WIDE
 
-            sg_update(p, q, pG, qG, kALIGN, model.k, param.eta,
-                      param.lambda, error, rk_fast, param.do_nmf);
+#endif // RECO_X86_SIMD
 
-        }
-        sched.put_job(block, loss);
-        if(sched.is_terminated())
+#if defined RECO_X86_WIDE
+// Whether the CPU converts between fp16 and fp32, which the wide kernels
+// do for half-precision factors
+bool cpu_supports_f16c()
+{
+#if defined __clang__ || __GNUC__ >= 11
+    return __builtin_cpu_supports("f16c") != 0;
+#else
+    unsigned int eax, ebx, ecx, edx;
+    return __get_cpuid(1, &eax, &ebx, &ecx, &edx) && (ecx & bit_F16C) != 0;
+#endif
+}
+#endif
+
+// Picks the widest kernels that the CPU supports. The environment
+// variable RECO_SIMD can name a narrower variant to use instead, for
+// example to compare results across variants.
+Kernels select_kernels()
+{
+    // From the narrowest to the widest, with whether the CPU supports them
+    vector<pair<Kernels, bool>> candidates = {{generic::table, true}};
+#if defined RECO_X86_SIMD
+    __builtin_cpu_init();
+    candidates.push_back({sse::table, __builtin_cpu_supports("sse3") != 0});
+#if defined RECO_X86_WIDE
+    // The kernels are compiled for all the features of their target
+    bool avx2 = __builtin_cpu_supports("avx2") &&
+                __builtin_cpu_supports("fma") && cpu_supports_f16c();
+    candidates.push_back({avx2::table, avx2});
+    candidates.push_back({avx512::table,
+                          avx2 && __builtin_cpu_supports("avx512f")});
+#endif
+#endif
+
+    char const *limit = getenv("RECO_SIMD");
+    Kernels selected = candidates[0].first;
+    for(auto const &candidate : candidates)
+    {
+        if(candidate.second)
+            selected = candidate.first;
+        if(limit != nullptr && strcmp(limit, candidate.first.name) == 0)
             break;
     }
+#if defined RECO_X86_VNNI
+    if(strcmp(selected.name, "avx512") == 0 &&
+       __builtin_cpu_supports("avx512bw") &&
+       __builtin_cpu_supports("avx512vnni"))
+        selected.dot_int8 = avx512::dot_int8_vnni;
 #endif
+    return selected;
+}
+
+Kernels const& kernels()
+{
+    static Kernels const selected = select_kernels();
+    return selected;
 }
 
 void scale_problem(mf_problem &prob, mf_float scale)
 {
-#if defined USEOMP
-#pragma omp parallel for schedule(static)
-#endif
-    for(mf_long i = 0; i < prob.nnz; i++)
+    parallel_for(prob.nnz, 1 << 16, [&] (mf_long i)
+    {
         prob.R[i].r *= scale;
+    });
 }
 
 void scale_model(mf_model &model, mf_float scale)
@@ -754,91 +2103,94 @@ void scale_model(mf_model &model, mf_float scale)
 
     auto scale1 = [&] (mf_float *ptr, mf_int size)
     {
-#if defined USEOMP
-#pragma omp parallel for schedule(static)
-#endif
-        for(mf_int i = 0; i < size; i++)
+        parallel_for(size, 1024, [&] (mf_long i)
         {
-            mf_float *ptr1 = ptr+(mf_long)i*model.k;
+            mf_float *ptr1 = ptr+i*model.k;
             for(mf_int d = 0; d < k; d++)
                 ptr1[d] *= scale;
-        }
+        });
     };
 
     scale1(model.P, model.m);
     scale1(model.Q, model.n);
 }
 
-mf_float inner_product(mf_float *p, mf_float *q, mf_int k)
-{
-#if defined USESSE
-    __m128 XMM = _mm_setzero_ps();
-    for(mf_int d = 0; d < k; d += 4)
-        XMM = _mm_add_ps(XMM, _mm_mul_ps(
-                  _mm_load_ps(p+d), _mm_load_ps(q+d)));
-    XMM = _mm_hadd_ps(XMM, XMM);
-    XMM = _mm_hadd_ps(XMM, XMM);
-    mf_float product;
-    _mm_store_ss(&product, XMM);
-    return product;
-#elif defined USEAVX
-    __m256 XMM = _mm256_setzero_ps();
-    for(mf_int d = 0; d < k; d += 8)
-        XMM = _mm256_add_ps(XMM, _mm256_mul_ps(
-                  _mm256_load_ps(p+d), _mm256_load_ps(q+d)));
-    XMM = _mm256_add_ps(XMM, _mm256_permute2f128_ps(XMM, XMM, 1));
-    XMM = _mm256_hadd_ps(XMM, XMM);
-    XMM = _mm256_hadd_ps(XMM, XMM);
-    mf_float product;
-    _mm_store_ss(&product, _mm256_castps256_ps128(XMM));
-    return product;
-#else
-    return std::inner_product(p, p+k, q, (mf_float)0.0);
-#endif
-}
-
-mf_double calc_reg(mf_model &model, vector<mf_int> &omega_p, vector<mf_int> &omega_q)
+mf_double calc_reg(FactorRows const &factors, vector<mf_int> &omega_p,
+                   vector<mf_int> &omega_q)
 {
-    auto calc_reg1 = [&] (mf_float *ptr, mf_int size, vector<mf_int> &omega)
+    auto calc_reg1 = [&] (char const *ptr, mf_int size, vector<mf_int> &omega)
     {
-        mf_double reg = 0;
-#if defined USEOMP
-#pragma omp parallel for schedule(static) reduction(+:reg)
-#endif
-        for(mf_int i = 0; i < size; i++)
+        auto sq_norm = kernels().sq_norm[factors.precision];
+        return sum_in_chunks(size, [&] (mf_long i)
         {
-            mf_float *ptr1 = ptr+(mf_long)i*model.k;
-            reg += omega[i]*inner_product(ptr1, ptr1, model.k);
-        }
-
-        return reg;
+            return (mf_double)omega[i]*sq_norm(ptr+i*factors.row_bytes,
+                                               factors.k);
+        });
     };
 
-    return calc_reg1(model.P, model.m, omega_p) +
-           calc_reg1(model.Q, model.n, omega_q);
+    return calc_reg1((char const *)factors.P, factors.m, omega_p) +
+           calc_reg1((char const *)factors.Q, factors.n, omega_q);
 }
 
-mf_double calc_loss(mf_node *R, mf_long size, mf_model const &model)
+mf_double calc_loss(mf_node *R, mf_long size, FactorRows const &factors)
 {
-    mf_double loss = 0;
-#if defined USEOMP
-#pragma omp parallel for schedule(static) reduction(+:loss)
-#endif
-    for(mf_long i = 0; i < size; i++)
+    // The model being trained is aligned, so the rows can be read with
+    // the training kernels
+    auto inner_product = kernels().inner_product[factors.precision];
+    char const *P = (char const *)factors.P;
+    char const *Q = (char const *)factors.Q;
+    return sum_in_chunks(size, [&] (mf_long i)
     {
         mf_node &N = R[i];
-        mf_float e = N.r - mf_predict(&model, N.u, N.v);
+        mf_float e = N.r;
+        if(N.u >= 0 && N.u < factors.m && N.v >= 0 && N.v < factors.n)
+            e -= inner_product(P+N.u*factors.row_bytes,
+                               Q+N.v*factors.row_bytes, factors.k);
+        return (mf_double)e*e;
+    });
+}
+
+template<typename Node>
+mf_double calc_block_loss(Grid const &grid, mf_int block,
+                          FactorRows const &factors)
+{
+    auto inner_product = kernels().inner_product[factors.precision];
+    char const *P = (char const *)factors.P;
+    char const *Q = (char const *)factors.Q;
+    BlockNodes<Node> nodes(grid, block);
+    mf_double loss = 0;
+    for(Node const *N = nodes.begin; N != nodes.end; N++)
+    {
+        mf_float e = nodes.r(*N)-
+                     inner_product(P+nodes.u(*N)*factors.row_bytes,
+                                   Q+nodes.v(*N)*factors.row_bytes, factors.k);
         loss += e*e;
     }
     return loss;
 }
 
-mf_double calc_rmse(mf_problem &prob, mf_model &model)
+// Loss over the given blocks of the training set, summed in the order of
+// the blocks so that it does not depend on the threads
+mf_double calc_loss(Grid const &grid, vector<mf_int> const &blocks,
+                    FactorRows const &factors)
+{
+    vector<mf_double> losses(blocks.size());
+    parallel_for((mf_long)blocks.size(), 1, [&] (mf_long i)
+    {
+        if(grid.packed())
+            losses[i] = calc_block_loss<PackedNode>(grid, blocks[i], factors);
+        else
+            losses[i] = calc_block_loss<mf_node>(grid, blocks[i], factors);
+    });
+    return accumulate(losses.begin(), losses.end(), 0.0);
+}
+
+mf_double calc_rmse(mf_problem &prob, FactorRows const &factors)
 {
     if(prob.nnz == 0)
         return 0;
 
-    mf_double loss = calc_loss(prob.R, prob.nnz, model);
+    mf_double loss = calc_loss(prob.R, prob.nnz, factors);
 
     return sqrt(loss/prob.nnz);
 }
@@ -848,20 +2200,17 @@ void shuffle_problem(
     vector<mf_int> &p_map,
     vector<mf_int> &q_map)
 {
-#if defined USEOMP
-#pragma omp parallel for schedule(static)
-#endif
-    for(mf_long i = 0; i < prob.nnz; i++)
+    parallel_for(prob.nnz, 1 << 16, [&] (mf_long i)
     {
         mf_node &N = prob.R[i];
         if(N.u < (mf_int) p_map.size())
             N.u = p_map[N.u];
         if(N.v < (mf_int) q_map.size())
             N.v = q_map[N.v];
-    }
+    });
 }
 
-vector<mf_node*> grid_problem(mf_problem &prob, mf_int nr_bins)
+void grid_problem(mf_problem &prob, mf_int nr_bins, Grid &grid)
 {
     vector<mf_long> counts(nr_bins*nr_bins, 0);
 
@@ -873,65 +2222,280 @@ vector<mf_node*> grid_problem(mf_problem &prob, mf_int nr_bins)
         return (u/seg_p)*nr_bins+v/seg_q;
     };
 
-    for(mf_long i = 0; i < prob.nnz; i++)
+    for(mf_long i = 0; i < prob.nnz; i++)
+    {
+        mf_node &N = prob.R[i];
+        mf_int block = get_block(N.u, N.v);
+        counts[block]++;
+    }
+
+    vector<mf_node*> ptrs(nr_bins*nr_bins+1);
+    mf_node *ptr = prob.R;
+    ptrs[0] = ptr;
+    for(mf_int block = 0; block < nr_bins*nr_bins; block++)
+        ptrs[block+1] = ptrs[block] + counts[block];
+
+    vector<mf_node*> pivots(ptrs.begin(), ptrs.end()-1);
+    for(mf_int block = 0; block < nr_bins*nr_bins; block++)
+    {
+        for(mf_node* pivot = pivots[block]; pivot != ptrs[block+1];)
+        {
+            mf_int curr_block = get_block(pivot->u, pivot->v);
+            if(curr_block == block)
+            {
+                pivot++;
+                continue;
+            }
+
+            mf_node *next = pivots[curr_block];
+            swap(*pivot, *next);
+            pivots[curr_block]++;
+        }
+    }
+
+    struct sort_node_by_p
+    {
+        bool operator() (mf_node const &lhs, mf_node const &rhs)
+        {
+            return tie(lhs.u, lhs.v) < tie(rhs.u, rhs.v);
+        }
+    };
+
+    struct sort_node_by_q
+    {
+        bool operator() (mf_node const &lhs, mf_node const &rhs)
+        {
+            return tie(lhs.v, lhs.u) < tie(rhs.v, rhs.u);
+        }
+    };
+
+    parallel_for(nr_bins*nr_bins, 1, [&] (mf_long block)
+    {
+        if(prob.m > prob.n)
+            sort(ptrs[block], ptrs[block+1], sort_node_by_p());
+        else
+            sort(ptrs[block], ptrs[block+1], sort_node_by_q());
+    });
+
+    grid.nr_bins = nr_bins;
+    grid.seg_p = seg_p;
+    grid.seg_q = seg_q;
+    grid.ptrs = move(ptrs);
+}
+
+// Indices of the distinct ratings of a training set, in an open addressing
+// table keyed on the bits of the ratings
+class RatingIndex
+{
+public:
+    RatingIndex() : slots(kSize, -1) {}
+
+    // Returns the index of r, adding it if it is new, or -1 if r is NaN
+    // or there are already kMaxPackedIndex distinct ratings
+    mf_int find(mf_float r)
+    {
+        if(std::isnan(r))
+            return -1;
+        r += 0.0f;  // -0 and 0 share an index
+
+        uint32_t bits;
+        memcpy(&bits, &r, sizeof(bits));
+        for(uint32_t slot = (bits*2654435769u) >> (32-kBits);;
+            slot = (slot+1) & (kSize-1))
+        {
+            if(slots[slot] < 0)
+            {
+                if((mf_int)values.size() == kMaxPackedIndex)
+                    return -1;
+                slots[slot] = (mf_int)values.size();
+                values.push_back(r);
+            }
+            if(values[slots[slot]] == r)
+                return slots[slot];
+        }
+    }
+
+    vector<mf_float> values;
+
+private:
+    static mf_int const kBits = 17;
+    static mf_int const kSize = 1 << kBits;  // at most half full
+    vector<mf_int> slots;
+};
+
+// Stable counting sort of nodes by a local row or column, field, which is
+// less than size. buf and offsets are scratch space kept by the caller.
+void sort_nodes(PackedNode *first, PackedNode *last,
+                uint16_t PackedNode::*field, mf_int size,
+                vector<PackedNode> &buf, vector<mf_long> &offsets)
+{
+    offsets.assign(size+1, 0);
+    for(PackedNode *N = first; N != last; N++)
+        offsets[N->*field+1]++;
+    partial_sum(offsets.begin(), offsets.end(), offsets.begin());
+
+    buf.resize(last-first);
+    for(PackedNode *N = first; N != last; N++)
+        buf[offsets[N->*field]++] = *N;
+    copy(buf.begin(), buf.end(), first);
+}
+
+// Stable sort of the nodes of a block by major and then minor field, which
+// are less than nr_major and nr_minor. Blocks with fewer nodes than rows
+// or columns are sorted by comparison, so that the cost follows the nodes
+// rather than the size of the block.
+void sort_block(PackedNode *first, PackedNode *last,
+                uint16_t PackedNode::*major, mf_int nr_major,
+                uint16_t PackedNode::*minor, mf_int nr_minor,
+                vector<PackedNode> &buf, vector<mf_long> &offsets)
+{
+    if(last-first < max(nr_major, nr_minor))
+    {
+        stable_sort(first, last, [=] (PackedNode const &lhs,
+                                      PackedNode const &rhs)
+        {
+            return tie(lhs.*major, lhs.*minor) < tie(rhs.*major, rhs.*minor);
+        });
+        return;
+    }
+
+    sort_nodes(first, last, minor, nr_minor, buf, offsets);
+    sort_nodes(first, last, major, nr_major, buf, offsets);
+}
+
+// Grids the training set into packed blocks, leaving prob untouched. Rows
+// and columns are shuffled by p_map and q_map, and the ratings scaled,
+// as for grid_problem(). Returns false if the blocks span too many rows
+// or columns, or there are too many distinct ratings, to index in 16 bits.
+bool pack_problem(mf_problem const &prob, mf_int nr_bins,
+                  vector<mf_int> const &p_map, vector<mf_int> const &q_map,
+                  mf_float scale, NumaPlan const &plan, Grid &grid)
+{
+    mf_int nr_blocks = nr_bins*nr_bins;
+    mf_int seg_p = (mf_int)ceil((double)prob.m/nr_bins);
+    mf_int seg_q = (mf_int)ceil((double)prob.n/nr_bins);
+    if(seg_p > kMaxPackedIndex || seg_q > kMaxPackedIndex)
+        return false;
+
+    auto get_block = [=] (mf_int u, mf_int v)
+    {
+        return (u/seg_p)*nr_bins+v/seg_q;
+    };
+
+    // The nodes are split into a chunk per thread. Each chunk counts its
+    // nodes in every block and indexes its ratings, and then writes its
+    // nodes after those of the chunks before it, so that the blocks come
+    // out as if the nodes were visited in order.
+    mf_int nr_chunks = (mf_int)max((mf_long)1, min(
+        (mf_long)thread_pool().get_nr_threads(), prob.nnz/(1 << 16)));
+    auto chunk_begin = [&] (mf_int chunk)
     {
-        mf_node &N = prob.R[i];
-        mf_int block = get_block(N.u, N.v);
-        counts[block]++;
-    }
-
-    vector<mf_node*> ptrs(nr_bins*nr_bins+1);
-    mf_node *ptr = prob.R;
-    ptrs[0] = ptr;
-    for(mf_int block = 0; block < nr_bins*nr_bins; block++)
-        ptrs[block+1] = ptrs[block] + counts[block];
+        return prob.nnz*chunk/nr_chunks;
+    };
 
-    vector<mf_node*> pivots(ptrs.begin(), ptrs.end()-1);
-    for(mf_int block = 0; block < nr_bins*nr_bins; block++)
+    // Ratings usually come in runs of the same value, which are indexed
+    // once
+    vector<RatingIndex> chunk_indices(nr_chunks);
+    vector<vector<mf_long>> counts(nr_chunks);
+    atomic<bool> failed(false);
+    thread_pool().run(nr_chunks, [&] (mf_int chunk)
     {
-        for(mf_node* pivot = pivots[block]; pivot != ptrs[block+1];)
+        RatingIndex &index = chunk_indices[chunk];
+        counts[chunk].assign(nr_blocks, 0);
+        for(mf_long i = chunk_begin(chunk); i < chunk_begin(chunk+1); i++)
         {
-            mf_int curr_block = get_block(pivot->u, pivot->v);
-            if(curr_block == block)
+            mf_node const &N = prob.R[i];
+            counts[chunk][get_block(p_map[N.u], q_map[N.v])]++;
+            if((i == chunk_begin(chunk) || N.r != prob.R[i-1].r) &&
+               index.find(N.r) < 0)
             {
-                pivot++;
-                continue;
+                failed = true;
+                return;
             }
-
-            mf_node *next = pivots[curr_block];
-            swap(*pivot, *next);
-            pivots[curr_block]++;
         }
-    }
+    });
+    if(failed)
+        return false;
+
+    // The ratings are indexed in the order they first appear, chunk by
+    // chunk, and the cursor of each chunk in a block is where the nodes of
+    // the chunks before it end
+    RatingIndex index;
+    vector<vector<uint16_t>> to_index(nr_chunks);
+    for(mf_int chunk = 0; chunk < nr_chunks; chunk++)
+        for(mf_float r : chunk_indices[chunk].values)
+        {
+            mf_int i = index.find(r);
+            if(i < 0)
+                return false;
+            to_index[chunk].push_back((uint16_t)i);
+        }
 
-    struct sort_node_by_p
+    vector<mf_long> offsets(nr_blocks+1, 0);
+    for(mf_int block = 0; block < nr_blocks; block++)
     {
-        bool operator() (mf_node const &lhs, mf_node const &rhs)
+        offsets[block+1] = offsets[block];
+        for(mf_int chunk = 0; chunk < nr_chunks; chunk++)
         {
-            return tie(lhs.u, lhs.v) < tie(rhs.u, rhs.v);
+            mf_long count = counts[chunk][block];
+            counts[chunk][block] = offsets[block+1];
+            offsets[block+1] += count;
         }
-    };
+    }
 
-    struct sort_node_by_q
+    grid.nodes.resize(prob.nnz);
+    plan.place_blocks(grid.nodes.data(), offsets, sizeof(PackedNode));
+    thread_pool().run(nr_chunks, [&] (mf_int chunk)
     {
-        bool operator() (mf_node const &lhs, mf_node const &rhs)
+        vector<mf_long> &cursors = counts[chunk];
+        uint16_t r = 0;
+        for(mf_long i = chunk_begin(chunk); i < chunk_begin(chunk+1); i++)
         {
-            return tie(lhs.v, lhs.u) < tie(rhs.v, rhs.u);
+            mf_node const &N = prob.R[i];
+            if(i == chunk_begin(chunk) || N.r != prob.R[i-1].r)
+                r = to_index[chunk][chunk_indices[chunk].find(N.r)];
+
+            mf_int u = p_map[N.u];
+            mf_int v = q_map[N.v];
+            PackedNode &node = grid.nodes[cursors[get_block(u, v)]++];
+            node.u = (uint16_t)(u%seg_p);
+            node.v = (uint16_t)(v%seg_q);
+            node.r = r;
         }
-    };
+    });
 
-#if defined USEOMP
-#pragma omp parallel for schedule(dynamic)
-#endif
-    for(mf_int block = 0; block < nr_bins*nr_bins; block++)
+    // The blocks are ordered as in grid_problem(), by row and then column
+    // or the other way round
+    uint16_t PackedNode::*major = &PackedNode::u;
+    uint16_t PackedNode::*minor = &PackedNode::v;
+    mf_int nr_major = seg_p, nr_minor = seg_q;
+    if(prob.m <= prob.n)
     {
-        if(prob.m > prob.n)
-            sort(ptrs[block], ptrs[block+1], sort_node_by_p());
-        else
-            sort(ptrs[block], ptrs[block+1], sort_node_by_q());
+        swap(major, minor);
+        swap(nr_major, nr_minor);
     }
 
-    return ptrs;
+    atomic<mf_int> next_block(0);
+    thread_pool().run(thread_pool().get_nr_threads(), [&] (mf_int)
+    {
+        vector<PackedNode> buf;
+        vector<mf_long> sort_offsets;
+        mf_int block;
+        while((block = next_block++) < nr_blocks)
+            sort_block(grid.nodes.data()+offsets[block],
+                       grid.nodes.data()+offsets[block+1], major, nr_major,
+                       minor, nr_minor, buf, sort_offsets);
+    });
+
+    grid.nr_bins = nr_bins;
+    grid.seg_p = seg_p;
+    grid.seg_q = seg_q;
+    grid.offsets = move(offsets);
+    grid.values = move(index.values);
+    for(mf_float &value : grid.values)
+        value *= scale;
+
+    return true;
 }
 
 vector<mf_int> gen_random_map(mf_int size)
@@ -1039,30 +2603,145 @@ mf_problem* copy_problem(mf_problem const *prob, bool copy_data)
     return new_prob;
 }
 
+// Runs the SGD iterations on a gridded problem. grid holds the blocks of
+// the shuffled and scaled training set, which are either in memory or in
+// a mapped block file, and plan the placement of threads and data.
+void fpsg_iterate(
+    Grid const &grid,
+    NumaPlan const &plan,
+    mf_model &model,
+    mf_problem &va,
+    mf_parameter param,
+    vector<mf_int> &omega_p,
+    vector<mf_int> &omega_q,
+    mf_long tr_nnz,
+    mf_float std_dev,
+    vector<mf_int> &cv_blocks,
+    mf_double *cv_loss,
+    mf_long *cv_count,
+    Reco::MappedFile const *block_file)
+{
+    // The AdaGrad sums are placed with their rows, before they are set
+    unique_ptr<mf_float[]> PG(new mf_float[model.m*2]);
+    unique_ptr<mf_float[]> QG(new mf_float[model.n*2]);
+    plan.place_rows(PG.get(), model.m, 2*sizeof(mf_float));
+    plan.place_rows(QG.get(), model.n, 2*sizeof(mf_float));
+    fill(PG.get(), PG.get()+model.m*2, 1);
+    fill(QG.get(), QG.get()+model.n*2, 1);
+
+    Factors factors(model, param.precision, plan);
+
+    unique_ptr<SnapshotQueue> snapshots;
+    function<void(mf_int, mf_double)> iter_done;
+    function<void()> while_held;
+    if(!param.quiet)
+    {
+        snapshots.reset(new SnapshotQueue(factors));
+        iter_done = [&](mf_int iter, mf_double loss)
+        {
+            snapshots->push(iter, factors, loss);
+        };
+        while_held = [&] { snapshots->help(); };
+    }
 
+    Scheduler sched(param.nr_bins, param.nr_threads, param.nr_iters, cv_blocks,
+                    param.deterministic != 0, plan.bin_nodes(),
+                    plan.thread_nodes(), iter_done, while_held);
 
-#ifdef USE_PTHREADS
-typedef struct
-{
-    vector<mf_node*> *ptrs;
-    mf_model *model;
-    Scheduler *sched;
-    mf_parameter *param;
-    bool slow_only;
-    mf_float *PG;
-    mf_float *QG;
-} PthreadData;
-
-void *sg_wrapper(void *data)
-{
-    PthreadData *pdata = (PthreadData *) data;
-    sg(*(pdata->ptrs), *(pdata->model), *(pdata->sched),
-       *(pdata->param), pdata->slow_only, pdata->PG, pdata->QG);
-    pthread_exit(nullptr);
-    
-    return nullptr; // should not reach here
+
+    SgKernel sg = kernels().select_sg(grid.packed(), factors.k,
+                                      factors.precision, param.do_implicit,
+                                      param.do_nmf);
+
+    thread_pool().start(param.nr_threads, [&] (mf_int i)
+    {
+        plan.pin(i);
+        sg(grid, factors, sched, param, PG.get(), QG.get(), block_file, i);
+        plan.unpin();
+    });
+
+    if(!param.quiet)
+    {
+        Rcout.width(4);
+        Rcout << "iter";
+        Rcout.width(10);
+        Rcout << "tr_rmse";
+        if(va.nnz != 0)
+        {
+            Rcout.width(10);
+            Rcout << "va_rmse";
+        }
+        Rcout.width(13);
+        Rcout << "obj";
+        Rcout << "\n";
+
+        // The report is computed on the main thread alone, as the pool
+        // is busy with the training threads
+        thread_pool().set_nr_threads(1);
+        for(mf_int iter = 0; iter < param.nr_iters; iter++)
+        {
+            mf_double tr_loss;
+            Snapshot const &snapshot = snapshots->front(iter, tr_loss);
+            tr_loss *= std_dev*std_dev;
+
+            mf_double reg = calc_reg(snapshot, omega_p, omega_q)*
+                            param.lambda*std_dev*std_dev;
+
+            mf_double tr_rmse = sqrt(tr_loss/tr_nnz);
+
+            Rcout.width(4);
+            Rcout << iter;
+            Rcout.width(10);
+            Rcout << fixed << setprecision(4) << tr_rmse;
+            if(va.nnz != 0)
+            {
+                mf_double va_rmse = calc_rmse(va, snapshot)*std_dev;
+                Rcout.width(10);
+                Rcout << fixed << setprecision(4) << va_rmse;
+            }
+            Rcout.width(13);
+            Rcout << fixed << setprecision(4) << scientific << reg+tr_loss;
+            Rcout << "\n" << flush;
+
+            snapshots->pop();
+        }
+        thread_pool().set_nr_threads(param.nr_threads);
+    }
+
+    thread_pool().join();
+
+    if(!param.quiet)
+    {
+        vector<mf_int> blocks(grid.nr_bins*grid.nr_bins);
+        iota(blocks.begin(), blocks.end(), 0);
+        mf_double loss = calc_loss(grid, blocks, factors)*std_dev*std_dev;
+        Rcout << "real tr_rmse = " << fixed << setprecision(4) << sqrt(loss/tr_nnz) << endl;
+    }
+
+    if(cv_loss != nullptr && cv_count != nullptr)
+    {
+        *cv_loss = calc_loss(grid, cv_blocks, factors)*std_dev*std_dev;
+        *cv_count = 0;
+        for(auto block : cv_blocks)
+            *cv_count += grid.size(block);
+    }
+
+    factors.widen();
+}
+
+// Scales the model back to the original ratings, drops the padding of
+// the latent dimensions and undoes the random shuffle of rows and columns
+void restore_model(
+    mf_model &model,
+    mf_int k,
+    mf_float std_dev,
+    vector<mf_int> &inv_p_map,
+    vector<mf_int> &inv_q_map)
+{
+    scale_model(model, sqrt(std_dev));
+    shrink_model(model, k);
+    shuffle_model(model, inv_p_map, inv_q_map);
 }
-#endif
 
 shared_ptr<mf_model> fpsg(
     mf_problem const *tr_,
@@ -1070,21 +2749,25 @@ shared_ptr<mf_model> fpsg(
     mf_parameter param,
     vector<mf_int> cv_blocks=vector<mf_int>(),
     mf_double *cv_loss=nullptr,
-    mf_long *cv_count=nullptr)
+    mf_long *cv_count=nullptr,
+    function<void()> release_tr=nullptr)
 {
-#if defined USESSE || defined USEAVX
+#if defined RECO_X86_SIMD && defined __SSE__
     _MM_SET_FLUSH_ZERO_MODE(_MM_FLUSH_ZERO_ON);
 #endif
 
-#if defined USEOMP
-    mf_int old_nr_threads = omp_get_num_threads();
-    omp_set_num_threads(param.nr_threads);
-#endif
+    mf_int old_nr_threads = thread_pool().get_nr_threads();
+    thread_pool().set_nr_threads(param.nr_threads);
 
     param.nr_bins = max(param.nr_bins, 2*param.nr_threads);
 
-    shared_ptr<mf_problem> tr, va;
-    if(param.copy_data)
+    // The training set may be released once packed, so its sizes are kept
+    mf_int m = tr_->m, n = tr_->n;
+    mf_long nnz = tr_->nnz;
+
+    NumaPlan plan(param);
+
+    auto copy = [&] (mf_problem const *prob)
     {
         struct deleter
         {
@@ -1095,173 +2778,286 @@ shared_ptr<mf_model> fpsg(
             }
         };
 
-        tr = shared_ptr<mf_problem>(copy_problem(tr_, true), deleter());
-        va = shared_ptr<mf_problem>(copy_problem(va_, true), deleter());
-    }
-    else
+        if(param.copy_data)
+            return shared_ptr<mf_problem>(copy_problem(prob, true), deleter());
+        return shared_ptr<mf_problem>(copy_problem(prob, false));
+    };
+
+    vector<mf_int> p_map = gen_random_map(tr_->m);
+    vector<mf_int> q_map = gen_random_map(tr_->n);
+
+    mf_float std_dev = calc_std_dev(*tr_);
+
+    vector<mf_int> omega_p(tr_->m, 0), omega_q(tr_->n, 0);
+    for(mf_long i = 0; i < tr_->nnz; i++)
     {
-        tr = shared_ptr<mf_problem>(copy_problem(tr_, false));
-        va = shared_ptr<mf_problem>(copy_problem(va_, false));
+        mf_node const &N = tr_->R[i];
+        omega_p[p_map[N.u]]++;
+        omega_q[q_map[N.v]]++;
     }
 
-    vector<mf_int> p_map = gen_random_map(tr->m);
-    vector<mf_int> q_map = gen_random_map(tr->n);
+    // The training set is packed straight from tr_ when possible, so that
+    // it is neither copied nor modified. Otherwise it is copied if asked
+    // to, and shuffled, gridded and scaled in place.
+    Grid grid;
+    shared_ptr<mf_problem> tr;
+    if(!pack_problem(*tr_, param.nr_bins, p_map, q_map, 1.0/std_dev, plan,
+                     grid))
+    {
+        tr = copy(tr_);
+        shuffle_problem(*tr, p_map, q_map);
+        grid_problem(*tr, param.nr_bins, grid);
+        scale_problem(*tr, 1.0/std_dev);
+    }
+    else if(release_tr)
+    {
+        tr_ = nullptr;
+        release_tr();
+    }
 
-    shuffle_problem(*tr, p_map, q_map);
+    shared_ptr<mf_problem> va = copy(va_);
     shuffle_problem(*va, p_map, q_map);
-
-    vector<mf_node*> ptrs = grid_problem(*tr, param.nr_bins);
+    scale_problem(*va, 1.0/std_dev);
+    param.lambda /= std_dev;
 
     mf_int k_aligned = (mf_int)ceil(mf_double(param.k)/kALIGN)*kALIGN;
 
-    shared_ptr<mf_model> model(init_model(tr->m, tr->n, param.k, k_aligned),
+    shared_ptr<mf_model> model(init_model(m, n, param.k, k_aligned, plan),
                                [] (mf_model *ptr) { mf_destroy_model(&ptr); });
 
+    fpsg_iterate(grid, plan, *model, *va, param, omega_p, omega_q, nnz,
+                 std_dev, cv_blocks, cv_loss, cv_count, nullptr);
 
-    mf_float std_dev = calc_std_dev(*tr);
-
-    scale_problem(*tr, 1.0/std_dev);
-    scale_problem(*va, 1.0/std_dev);
-    param.lambda /= std_dev;
-
-    Scheduler sched(param.nr_bins, param.nr_threads, cv_blocks);
+    vector<mf_int> inv_p_map = gen_inv_map(p_map);
+    vector<mf_int> inv_q_map = gen_inv_map(q_map);
 
-    vector<mf_int> omega_p(tr->m, 0), omega_q(tr->n, 0);
-    for(mf_long i = 0; i < tr->nnz; i++)
+    if(!param.copy_data)
     {
-        mf_node &N = tr->R[i];
-        omega_p[N.u]++;
-        omega_q[N.v]++;
+        if(tr != nullptr)
+        {
+            scale_problem(*tr, std_dev);
+            shuffle_problem(*tr, inv_p_map, inv_q_map);
+        }
+        scale_problem(*va, std_dev);
+        shuffle_problem(*va, inv_p_map, inv_q_map);
     }
 
-    bool slow_only = true;
+    restore_model(*model, param.k, std_dev, inv_p_map, inv_q_map);
 
-    vector<mf_float> PG(model->m*2, 1), QG(model->n*2, 1);
+    thread_pool().set_nr_threads(old_nr_threads);
 
-#ifdef USE_PTHREADS
-    pthread_t *threads = new pthread_t[param.nr_threads];
-    PthreadData pdata = {&ptrs, model.get(), &sched, &param, slow_only, PG.data(), QG.data()};
-    for(mf_int i = 0; i < param.nr_threads; i++)
+    return model;
+}
+
+// Writes the grid blocks of an on-disk training set to block_path, so that
+// each block is a contiguous segment of the file. Rows and columns are
+// shuffled and ratings scaled on the way. Only P, Q and one write buffer
+// per block are held in memory.
+vector<mf_long> grid_problem_on_disk(
+    mf_node const *R,
+    mf_long nnz,
+    mf_int m,
+    mf_int n,
+    mf_int nr_bins,
+    vector<mf_int> &p_map,
+    vector<mf_int> &q_map,
+    mf_float scale,
+    char const *block_path)
+{
+    mf_int nr_blocks = nr_bins*nr_bins;
+    mf_int seg_p = (mf_int)ceil((double)m/nr_bins);
+    mf_int seg_q = (mf_int)ceil((double)n/nr_bins);
+
+    auto get_block = [=] (mf_int u, mf_int v)
     {
-        mf_int err = pthread_create(&threads[i], nullptr, sg_wrapper, &pdata);
-        if(err)
-            throw runtime_error("creating new thread failed");
-    }
-#else
-    vector<thread> threads;
-    for(mf_int i = 0; i < param.nr_threads; i++)
-        threads.emplace_back(sg, ref(ptrs), ref(*model), ref(sched), param,
-                             ref(slow_only), PG.data(), QG.data());
-#endif
+        return (u/seg_p)*nr_bins+v/seg_q;
+    };
+
+    vector<mf_long> offsets(nr_blocks+1, 0);
+    for(mf_long i = 0; i < nnz; i++)
+        offsets[get_block(p_map[R[i].u], q_map[R[i].v])+1]++;
+    for(mf_int block = 0; block < nr_blocks; block++)
+        offsets[block+1] += offsets[block];
 
-    if(!param.quiet)
     {
-        Rcout.width(4);
-        Rcout << "iter";
-        Rcout.width(10);
-        Rcout << "tr_rmse";
-        if(va->nnz != 0)
+        ofstream f(block_path, ios::binary | ios::trunc);
+        if(!f.is_open())
+            throw runtime_error(string("cannot write ") + block_path);
+
+        mf_long buffer_size = max((mf_long)256, kDiskBufferBytes/
+                                  ((mf_long)sizeof(mf_node)*nr_blocks));
+        vector<mf_node> buffers(buffer_size*nr_blocks);
+        vector<mf_long> filled(nr_blocks, 0);
+        vector<mf_long> cursors(offsets.begin(), offsets.end()-1);
+
+        auto flush = [&] (mf_int block)
         {
-            Rcout.width(10);
-            Rcout << "va_rmse";
+            f.seekp(cursors[block]*sizeof(mf_node));
+            f.write((char *)(buffers.data() + block*buffer_size),
+                    filled[block]*sizeof(mf_node));
+            cursors[block] += filled[block];
+            filled[block] = 0;
+        };
+
+        for(mf_long i = 0; i < nnz; i++)
+        {
+            mf_node N = R[i];
+            N.u = p_map[N.u];
+            N.v = q_map[N.v];
+            N.r *= scale;
+
+            mf_int block = get_block(N.u, N.v);
+            buffers[block*buffer_size + filled[block]] = N;
+            if(++filled[block] == buffer_size)
+                flush(block);
         }
-        Rcout.width(13);
-        Rcout << "obj";
-        Rcout << "\n";
+        for(mf_int block = 0; block < nr_blocks; block++)
+            flush(block);
+
+        if(!f)
+            throw runtime_error(string("cannot write ") + block_path);
     }
 
-    for(mf_int iter = 0; iter < param.nr_iters; iter++)
+    // Sort the nodes of each block as grid_problem() does, one block per
+    // thread at a time
+    bool sort_by_p = m > n;
+    atomic<mf_int> nr_failed(0);
+    atomic<mf_int> next_block(0);
+    thread_pool().run(thread_pool().get_nr_threads(), [&] (mf_int)
     {
-        sched.wait_for_jobs_done();
+        fstream f(block_path, ios::binary | ios::in | ios::out);
+        vector<mf_node> nodes;
 
-        if(!param.quiet)
+        mf_int block;
+        while((block = next_block++) < nr_blocks)
         {
-            mf_double reg = calc_reg(*model, omega_p, omega_q)*
-                            param.lambda*std_dev*std_dev;
+            nodes.resize(offsets[block+1]-offsets[block]);
+            f.seekg(offsets[block]*sizeof(mf_node));
+            f.read((char *)nodes.data(), nodes.size()*sizeof(mf_node));
+            sort(nodes.begin(), nodes.end(),
+                 [=] (mf_node const &lhs, mf_node const &rhs)
+                 {
+                     return sort_by_p ? tie(lhs.u, lhs.v) < tie(rhs.u, rhs.v)
+                                      : tie(lhs.v, lhs.u) < tie(rhs.v, rhs.u);
+                 });
+            f.seekp(offsets[block]*sizeof(mf_node));
+            f.write((char *)nodes.data(), nodes.size()*sizeof(mf_node));
+        }
 
-            mf_double tr_loss = sched.get_loss()*std_dev*std_dev;
+        if(!f)
+            nr_failed++;
+    });
 
-            mf_double tr_rmse = sqrt(tr_loss/tr->nnz);
+    if(nr_failed > 0)
+        throw runtime_error(string("cannot write ") + block_path);
 
-            Rcout.width(4);
-            Rcout << iter;
-            Rcout.width(10);
-            Rcout << fixed << setprecision(4) << tr_rmse;
-            if(va->nnz != 0)
-            {
-                mf_double va_rmse = calc_rmse(*va, *model)*std_dev;
-                Rcout.width(10);
-                Rcout << fixed << setprecision(4) << va_rmse;
-            }
-            Rcout.width(13);
-            Rcout << fixed << setprecision(4) << scientific << reg+tr_loss;
-            Rcout << "\n" << flush;
-        }
+    return offsets;
+}
 
-        if(iter == 0)
-            slow_only = false;
+shared_ptr<mf_model> fpsg_on_disk(
+    mf_disk_problem const *tr,
+    mf_problem const *va_,
+    mf_parameter param,
+    char const *block_path)
+{
+#if defined RECO_X86_SIMD && defined __SSE__
+    _MM_SET_FLUSH_ZERO_MODE(_MM_FLUSH_ZERO_ON);
+#endif
 
-        sched.resume();
-    }
-    sched.terminate();
+    mf_int old_nr_threads = thread_pool().get_nr_threads();
+    thread_pool().set_nr_threads(param.nr_threads);
 
-#ifdef USE_PTHREADS
-    for(mf_int i = 0; i < param.nr_threads; i++)
-        pthread_join(threads[i], NULL);
-    delete [] threads;
-#else
-    for(auto &thread : threads)
-        thread.join();
-#endif
+    // Besides leaving room for the threads, keep the blocks small enough
+    // that a few of them per thread comfortably fit in memory
+    mf_int min_bins = (mf_int)ceil(sqrt((double)tr->nnz*sizeof(mf_node)/
+                                        kDiskBlockBytes));
+    param.nr_bins = max(max(param.nr_bins, 2*param.nr_threads), min_bins);
 
-    mf_double loss = calc_loss(tr->R, tr->nnz, *model)*std_dev*std_dev;
+    Reco::MappedFile input;
+    if(!input.open(tr->path))
+        throw runtime_error(string("cannot open ") + tr->path);
+    if(input.size() < tr->offset + tr->nnz*sizeof(mf_node))
+        throw runtime_error(string(tr->path) + " is truncated");
+    input.advise_sequential();
+    mf_node const *R = (mf_node const *)(input.data() + tr->offset);
 
-    if(!param.quiet)
-        Rcout << "real tr_rmse = " << fixed << setprecision(4) << sqrt(loss/tr->nnz) << endl;
+    shared_ptr<mf_problem> va(copy_problem(va_, false));
 
-    if(cv_loss != nullptr && cv_count != nullptr)
+    vector<mf_int> p_map = gen_random_map(tr->m);
+    vector<mf_int> q_map = gen_random_map(tr->n);
+
+    mf_double sum = 0, sum2 = 0;
+    vector<mf_int> omega_p(tr->m, 0), omega_q(tr->n, 0);
+    for(mf_long i = 0; i < tr->nnz; i++)
     {
-        *cv_loss = 0;
-        *cv_count = 0;
-        for(auto block : cv_blocks)
-        {
-            *cv_loss += calc_loss(ptrs[block], ptrs[block+1]-ptrs[block], *model);
-            *cv_count += ptrs[block+1]-ptrs[block];
-        }
-        *cv_loss *= std_dev*std_dev;
+        sum += R[i].r;
+        sum2 += (mf_double)R[i].r*R[i].r;
+        omega_p[p_map[R[i].u]]++;
+        omega_q[q_map[R[i].v]]++;
     }
+    mf_double avg = sum/tr->nnz;
+    mf_float std_dev = (mf_float)sqrt(max(sum2/tr->nnz - avg*avg, 0.0));
+
+    // The block file is removed when this function returns or throws
+    struct remover
+    {
+        char const *path;
+        ~remover() { remove(path); }
+    } block_file_remover = {block_path};
+
+    vector<mf_long> offsets = grid_problem_on_disk(
+        R, tr->nnz, tr->m, tr->n, param.nr_bins, p_map, q_map,
+        1.0/std_dev, block_path);
+    input.close();
+
+    Reco::MappedFile block_file;
+    if(!block_file.open(block_path))
+        throw runtime_error(string("cannot open ") + block_path);
+
+    Grid grid;
+    grid.nr_bins = param.nr_bins;
+    grid.seg_p = (mf_int)ceil((double)tr->m/param.nr_bins);
+    grid.seg_q = (mf_int)ceil((double)tr->n/param.nr_bins);
+    grid.ptrs.resize(offsets.size());
+    for(size_t i = 0; i < offsets.size(); i++)
+        grid.ptrs[i] = (mf_node *)block_file.data() + offsets[i];
+
+    shuffle_problem(*va, p_map, q_map);
+    scale_problem(*va, 1.0/std_dev);
+    param.lambda /= std_dev;
+
+    mf_int k_aligned = (mf_int)ceil(mf_double(param.k)/kALIGN)*kALIGN;
+
+    // The blocks are in the page cache, so only the factors are placed
+    NumaPlan plan(param);
+    shared_ptr<mf_model> model(init_model(tr->m, tr->n, param.k, k_aligned,
+                                          plan),
+                               [] (mf_model *ptr) { mf_destroy_model(&ptr); });
+
+    vector<mf_int> cv_blocks;
+    fpsg_iterate(grid, plan, *model, *va, param, omega_p, omega_q, tr->nnz,
+                 std_dev, cv_blocks, nullptr, nullptr, &block_file);
 
     vector<mf_int> inv_p_map = gen_inv_map(p_map);
     vector<mf_int> inv_q_map = gen_inv_map(q_map);
 
-    if(!param.copy_data)
-    {
-        scale_problem(*tr, std_dev);
-        scale_problem(*va, std_dev);
-        shuffle_problem(*tr, inv_p_map, inv_q_map);
-        shuffle_problem(*va, inv_p_map, inv_q_map);
-    }
+    scale_problem(*va, std_dev);
+    shuffle_problem(*va, inv_p_map, inv_q_map);
 
-    scale_model(*model, sqrt(std_dev));
-    shrink_model(*model, param.k);
-    shuffle_model(*model, inv_p_map, inv_q_map);
+    restore_model(*model, param.k, std_dev, inv_p_map, inv_q_map);
 
-#if defined USEOMP
-    omp_set_num_threads(old_nr_threads);
-#endif
+    thread_pool().set_nr_threads(old_nr_threads);
 
     return model;
 }
 
 } // unnamed namespace
 
-mf_model* mf_train_with_validation(
-    mf_problem const *tr,
-    mf_problem const *va,
-    mf_parameter param)
+namespace
 {
-    shared_ptr<mf_model> model = fpsg(tr, va, param);
 
+mf_model* release_model(shared_ptr<mf_model> model)
+{
     mf_model *model_ret = new mf_model;
 
     model_ret->m = model->m;
@@ -1271,10 +3067,42 @@ mf_model* mf_train_with_validation(
     model_ret->P = model->P;
     model->P = nullptr;
 
-    model_ret->Q = model->Q;
-    model->Q = nullptr;
+    model_ret->Q = model->Q;
+    model->Q = nullptr;
+
+    model_ret->mapping = nullptr;
+
+    return model_ret;
+}
+
+} // unnamed namespace
+
+mf_model* mf_train_with_validation(
+    mf_problem const *tr,
+    mf_problem const *va,
+    mf_parameter param)
+{
+    return release_model(fpsg(tr, va, param));
+}
+
+mf_model* mf_train_with_release(
+    mf_problem const *tr,
+    mf_problem const *va,
+    mf_parameter param,
+    void (*release)(void *),
+    void *arg)
+{
+    return release_model(fpsg(tr, va, param, vector<mf_int>(), nullptr,
+                              nullptr, [=] { release(arg); }));
+}
 
-    return model_ret;
+mf_model* mf_train_on_disk(
+    mf_disk_problem const *tr,
+    mf_problem const *va,
+    mf_parameter param,
+    char const *block_path)
+{
+    return release_model(fpsg_on_disk(tr, va, param, block_path));
 }
 
 mf_model* mf_train(mf_problem const *prob, mf_parameter param)
@@ -1354,47 +3182,186 @@ mf_float mf_cross_validation(
     return rmse;
 }
 
+namespace
+{
+
+// Writes the file at path through write(f), into a temporary file next to
+// it that is then moved over it. Models loaded from the old file map it,
+// so it must not be truncated and rewritten in place.
+template<typename F>
+mf_int save_replacing(char const *path, F const &write)
+{
+    string tmp_path = string(path)+".tmp";
+    ofstream f(tmp_path, ios::binary);
+    if(!f.is_open())
+        return 1;
+
+    write(f);
+    f.close();
+    if(!f || !Reco::replace_file(tmp_path, path))
+    {
+        remove(tmp_path.c_str());
+        return 1;
+    }
+    return 0;
+}
+
+} // unnamed namespace
+
 mf_int mf_save_model(mf_model const *model, char const *path)
+{
+    auto align = [] (mf_long offset)
+    {
+        return (offset+kALIGNByte-1)/kALIGNByte*kALIGNByte;
+    };
+
+    ModelHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, kModelMagic, sizeof(kModelMagic));
+    header.version = kModelVersion;
+    header.m = model->m;
+    header.n = model->n;
+    header.k = model->k;
+    header.p_offset = sizeof(ModelHeader);
+    header.q_offset = align(header.p_offset +
+                            (mf_long)model->m*model->k*sizeof(mf_float));
+
+    char const padding[kALIGNByte] = {0};
+    mf_long p_size = (mf_long)model->m*model->k*sizeof(mf_float);
+    mf_long q_size = (mf_long)model->n*model->k*sizeof(mf_float);
+
+    return save_replacing(path, [&] (ofstream &f)
+    {
+        f.write((char *)&header, sizeof(header));
+        f.write((char *)model->P, p_size);
+        f.write(padding, header.q_offset-header.p_offset-p_size);
+        f.write((char *)model->Q, q_size);
+    });
+}
+
+mf_int mf_save_model_text(mf_model const *model, char const *path,
+                          mf_int nr_threads)
 {
     ofstream f(path);
     if(!f.is_open())
         return 1;
 
-    f << "m " << model->m << endl;
-    f << "n " << model->n << endl;
-    f << "k " << model->k << endl;
+    f << "m " << model->m << "\n";
+    f << "n " << model->n << "\n";
+    f << "k " << model->k << "\n";
+
+    // Rows are formatted by nr_threads threads, a chunk of about 1MB at a
+    // time, and the chunks are written out in order
+    mf_long nr_rows = (mf_long)model->m+model->n;
+    mf_long chunk_size = max((mf_long)1, (mf_long)(1 << 20)/(12*model->k+16));
+    mf_long nr_chunks = (nr_rows+chunk_size-1)/chunk_size;
 
-    auto write = [&] (mf_float *ptr, mf_int size, char prefix)
+#if defined USEOMP
+#pragma omp parallel num_threads(nr_threads)
+#endif
     {
-        for(mf_int i = 0; i < size; i++)
+        string buffer;
+        char value[32];
+
+#if defined USEOMP
+#pragma omp for ordered schedule(static, 1)
+#endif
+        for(mf_long chunk = 0; chunk < nr_chunks; chunk++)
         {
-            mf_float *ptr1 = ptr + (mf_long)i*model->k;
-            f << prefix << i << " ";
-            for(mf_int d = 0; d < model->k; d++)
-                f << ptr1[d] << " ";
-            f << endl;
-        }
-    };
+            buffer.clear();
+            mf_long end = min((chunk+1)*chunk_size, nr_rows);
+            for(mf_long row = chunk*chunk_size; row < end; row++)
+            {
+                bool is_p = row < model->m;
+                mf_int i = (mf_int)(is_p ? row : row-model->m);
+                mf_float const *ptr = (is_p ? model->P : model->Q) +
+                                      (mf_long)i*model->k;
+
+                // Same output as operator<< with the default precision
+                buffer += is_p ? 'p' : 'q';
+                buffer.append(value, snprintf(value, sizeof(value), "%d ", i));
+                for(mf_int d = 0; d < model->k; d++)
+                    buffer.append(value, snprintf(value, sizeof(value),
+                                                  "%g ", ptr[d]));
+                buffer += '\n';
+            }
 
-    write(model->P, model->m, 'p');
-    write(model->Q, model->n, 'q');
+#if defined USEOMP
+#pragma omp ordered
+#endif
+            f.write(buffer.data(), buffer.size());
+        }
+    }
 
-    return 0;
+    return f ? 0 : 1;
 }
 
-mf_model* mf_load_model(char const *path)
+namespace
+{
+
+mf_model* load_model_text(char const *path, mf_int nr_threads)
 {
-    ifstream f(path);
-    if(!f.is_open())
+    Reco::MappedFile file;
+    if(!file.open(path))
+        return nullptr;
+
+    char const *ptr = file.data();
+    char const *end = ptr+file.size();
+
+    // Header lines "m <m>", "n <n>" and "k <k>"
+    mf_int dims[3];
+    for(mf_int i = 0; i < 3; i++)
+    {
+        ptr = Reco::skip_blank(ptr, end);
+        while(ptr != end && !Reco::is_blank(*ptr) && *ptr != '\n')
+            ptr++;
+        if(!Reco::parse_int(ptr, end, dims[i]) || dims[i] < 0)
+            return nullptr;
+        ptr = Reco::next_line(ptr, end);
+    }
+
+    // Index the start of every row line, in parallel over a range of the
+    // file per thread: count the lines of each range first, then record
+    // their starts
+    mf_int nr_chunks = nr_threads;
+    vector<char const *> bounds = Reco::split_lines(ptr, end, nr_chunks);
+    vector<mf_long> offsets(nr_chunks+1, 0);
+
+#if defined USEOMP
+#pragma omp parallel for schedule(static, 1) num_threads(nr_threads)
+#endif
+    for(mf_int c = 0; c < nr_chunks; c++)
+        for(char const *p = bounds[c]; p != bounds[c+1];
+            p = Reco::next_line(p, bounds[c+1]))
+            offsets[c+1]++;
+
+    for(mf_int c = 0; c < nr_chunks; c++)
+        offsets[c+1] += offsets[c];
+
+    mf_long nr_rows = (mf_long)dims[0]+dims[1];
+    if(offsets.back() < nr_rows)
         return nullptr;
 
-    string dummy;
+    vector<char const *> lines(offsets.back());
+
+#if defined USEOMP
+#pragma omp parallel for schedule(static, 1) num_threads(nr_threads)
+#endif
+    for(mf_int c = 0; c < nr_chunks; c++)
+    {
+        mf_long i = offsets[c];
+        for(char const *p = bounds[c]; p != bounds[c+1];
+            p = Reco::next_line(p, bounds[c+1]))
+            lines[i++] = p;
+    }
 
     mf_model *model = new mf_model;
+    model->m = dims[0];
+    model->n = dims[1];
+    model->k = dims[2];
     model->P = nullptr;
     model->Q = nullptr;
-
-    f >> dummy >> model->m >> dummy >> model->n >> dummy >> model->k;
+    model->mapping = nullptr;
 
     try
     {
@@ -1407,23 +3374,90 @@ mf_model* mf_load_model(char const *path)
         return nullptr;
     }
 
-    auto read = [&] (mf_float *ptr, mf_int size)
+    // Each line is the "p<i>" or "q<i>" label followed by k values
+    mf_long nr_failed = 0;
+#if defined USEOMP
+#pragma omp parallel for schedule(static) reduction(+:nr_failed) num_threads(nr_threads)
+#endif
+    for(mf_long row = 0; row < nr_rows; row++)
     {
-        for(mf_int i = 0; i < size; i++)
+        bool is_p = row < model->m;
+        mf_float *ptr1 = (is_p ? model->P+row*model->k
+                               : model->Q+(row-model->m)*model->k);
+
+        char const *p = Reco::skip_blank(lines[row], end);
+        char const *eol = Reco::next_line(p, end);
+        while(p != eol && !Reco::is_blank(*p) && *p != '\n')
+            p++;
+        for(mf_int d = 0; d < model->k; d++)
         {
-            mf_float *ptr1 = ptr + (mf_long)i*model->k;
-            f >> dummy;
-            for(mf_int d = 0; d < model->k; d++)
-                f >> ptr1[d];
+            if(!Reco::parse_float(p, eol, ptr1[d]))
+            {
+                nr_failed++;
+                break;
+            }
         }
-    };
+    }
+
+    if(nr_failed > 0)
+    {
+        mf_destroy_model(&model);
+        return nullptr;
+    }
+
+    return model;
+}
+
+// P and Q point into a copy-on-write mapping of the file, so nothing is
+// read until it is used
+mf_model* load_model_binary(Reco::MappedFile *file)
+{
+    ModelHeader header;
+    memcpy(&header, file->data(), sizeof(header));
+
+    mf_long p_size = (mf_long)header.m*header.k*sizeof(mf_float);
+    mf_long q_size = (mf_long)header.n*header.k*sizeof(mf_float);
+    if(header.version != kModelVersion ||
+       header.m < 0 || header.n < 0 || header.k < 0 ||
+       header.p_offset % kALIGNByte != 0 ||
+       header.q_offset % kALIGNByte != 0 ||
+       header.p_offset + p_size > header.q_offset ||
+       (mf_long)file->size() < header.q_offset + q_size)
+    {
+        delete file;
+        return nullptr;
+    }
 
-    read(model->P, model->m);
-    read(model->Q, model->n);
+    mf_model *model = new mf_model;
+    model->m = header.m;
+    model->n = header.n;
+    model->k = header.k;
+    model->P = (mf_float *)(file->data() + header.p_offset);
+    model->Q = (mf_float *)(file->data() + header.q_offset);
+    model->mapping = file;
 
     return model;
 }
 
+} // unnamed namespace
+
+mf_model* mf_load_model(char const *path, mf_int nr_threads)
+{
+    Reco::MappedFile *file = new Reco::MappedFile;
+    if(!file->open(path))
+    {
+        delete file;
+        return nullptr;
+    }
+
+    if(file->size() >= sizeof(ModelHeader) &&
+       memcmp(file->data(), kModelMagic, sizeof(kModelMagic)) == 0)
+        return load_model_binary(file);
+
+    delete file;
+    return load_model_text(path, max(nr_threads, 1));
+}
+
 mf_float mf_predict(mf_model const *model, mf_int u, mf_int v)
 {
     if(u < 0 || u >= model->m || v < 0 || v >= model->n)
@@ -1432,27 +3466,459 @@ mf_float mf_predict(mf_model const *model, mf_int u, mf_int v)
     mf_float *p = model->P+(mf_long)u*model->k;
     mf_float *q = model->Q+(mf_long)v*model->k;
 
-    return std::inner_product(p, p+model->k, q, (mf_float)0);
+    return kernels().dot_product(p, q, model->k);
+}
+
+namespace
+{
+
+// Shared by mf_predict_nodes() and mf_qpredict_nodes()
+template<typename Model>
+void predict_nodes(Model const *model, mf_node *R, mf_long size,
+                   mf_int by_user, mf_int nr_threads,
+                   mf_float (*predict)(Model const *, mf_int, mf_int))
+{
+    // The pairs in the order they are scored
+    vector<mf_long> order;
+    if(by_user)
+    {
+        // Users out of the model share the bucket after the last user
+        mf_int m = max(model->m, 0);
+        auto bucket = [=] (mf_int u) { return u >= 0 && u < m ? u : m; };
+
+        order.resize(size);
+        if(size < m)
+        {
+            // Fewer pairs than users are sorted by comparison, so that the
+            // cost follows the pairs rather than the size of the model
+            iota(order.begin(), order.end(), 0);
+            stable_sort(order.begin(), order.end(),
+                        [&] (mf_long i, mf_long j)
+                        { return bucket(R[i].u) < bucket(R[j].u); });
+        }
+        else
+        {
+            vector<mf_long> offsets(m+2, 0);
+            for(mf_long i = 0; i < size; i++)
+                offsets[bucket(R[i].u)+1]++;
+            partial_sum(offsets.begin(), offsets.end(), offsets.begin());
+            for(mf_long i = 0; i < size; i++)
+                order[offsets[bucket(R[i].u)]++] = i;
+        }
+    }
+
+    // Each thread scores a contiguous run of the order, so that the pairs
+    // of a user mostly stay on one thread
+#if defined USEOMP
+#pragma omp parallel for schedule(static) num_threads(nr_threads)
+#endif
+    for(mf_long i = 0; i < size; i++)
+    {
+        mf_node &N = R[by_user ? order[i] : i];
+        N.r = predict(model, N.u, N.v);
+    }
+}
+
+// The search of mf_recommend() and mf_qrecommend() over a model of m
+// users and n items whose item rows take row_bytes each.
+// score(u, j0, j1, out) stores the ratings of items [j0, j1) for user u
+// in out[0], ..., out[j1-j0-1].
+template<typename Score>
+void recommend_top(
+    mf_int m,
+    mf_int n,
+    mf_long row_bytes,
+    mf_int const *users,
+    mf_int nr_users,
+    mf_int K,
+    mf_problem const *exclude,
+    mf_int nr_threads,
+    mf_int *items,
+    mf_float *scores,
+    Score score)
+{
+    // Items to skip for each user, as sorted rows of a CSR matrix
+    vector<mf_long> ex_ptr(m+1, 0);
+    vector<mf_int> ex_items;
+    if(exclude != nullptr)
+    {
+        for(mf_long i = 0; i < exclude->nnz; i++)
+        {
+            mf_node const &N = exclude->R[i];
+            if(N.u >= 0 && N.u < m)
+                ex_ptr[N.u+1]++;
+        }
+        for(mf_int u = 0; u < m; u++)
+            ex_ptr[u+1] += ex_ptr[u];
+
+        ex_items.resize(ex_ptr.back());
+        vector<mf_long> pos(ex_ptr.begin(), ex_ptr.end()-1);
+        for(mf_long i = 0; i < exclude->nnz; i++)
+        {
+            mf_node const &N = exclude->R[i];
+            if(N.u >= 0 && N.u < m)
+                ex_items[pos[N.u]++] = N.v;
+        }
+
+#if defined USEOMP
+#pragma omp parallel for schedule(dynamic, 1024) num_threads(nr_threads)
+#endif
+        for(mf_int u = 0; u < m; u++)
+            sort(ex_items.begin()+ex_ptr[u], ex_items.begin()+ex_ptr[u+1]);
+    }
+
+    // Users are scored a tile at a time against tiles of Q that stay in
+    // cache while every user of the tile is scored against them. Each
+    // user keeps a min-heap of its K best items so far.
+    typedef pair<mf_float, mf_int> Candidate;
+    const mf_int user_tile = 8;
+    const mf_int item_tile = (mf_int)max((mf_long)16, (1 << 15)/row_bytes);
+    const mf_int nr_tiles = (nr_users+user_tile-1)/user_tile;
+
+#if defined USEOMP
+#pragma omp parallel for schedule(dynamic) num_threads(nr_threads)
+#endif
+    for(mf_int tile = 0; tile < nr_tiles; tile++)
+    {
+        mf_int first = tile*user_tile;
+        mf_int last = min(first+user_tile, nr_users);
+
+        vector<vector<Candidate>> heaps(last-first);
+        vector<mf_long> cursors(last-first);
+        vector<mf_float> tile_scores(item_tile);
+        for(mf_int i = first; i < last; i++)
+        {
+            heaps[i-first].reserve(K);
+            if(users[i] >= 0 && users[i] < m)
+                cursors[i-first] = ex_ptr[users[i]];
+        }
+
+        for(mf_int j0 = 0; j0 < n; j0 += item_tile)
+        {
+            mf_int j1 = min(j0+item_tile, n);
+            for(mf_int i = first; i < last; i++)
+            {
+                mf_int u = users[i];
+                if(u < 0 || u >= m)
+                    continue;
+
+                vector<Candidate> &heap = heaps[i-first];
+                mf_long &cursor = cursors[i-first];
+                mf_long cursor_end = ex_ptr[u+1];
+
+                score(u, j0, j1, tile_scores.data());
+                for(mf_int j = j0; j < j1; j++)
+                {
+                    while(cursor < cursor_end && ex_items[cursor] < j)
+                        cursor++;
+                    if(cursor < cursor_end && ex_items[cursor] == j)
+                        continue;
+
+                    mf_float s = tile_scores[j-j0];
+                    if((mf_int)heap.size() < K)
+                    {
+                        heap.push_back(Candidate(s, j));
+                        push_heap(heap.begin(), heap.end(), greater<Candidate>());
+                    }
+                    else if(s > heap.front().first)
+                    {
+                        pop_heap(heap.begin(), heap.end(), greater<Candidate>());
+                        heap.back() = Candidate(s, j);
+                        push_heap(heap.begin(), heap.end(), greater<Candidate>());
+                    }
+                }
+            }
+        }
+
+        for(mf_int i = first; i < last; i++)
+        {
+            vector<Candidate> &heap = heaps[i-first];
+            sort_heap(heap.begin(), heap.end(), greater<Candidate>());
+
+            mf_int *items1 = items+(mf_long)i*K;
+            mf_float *scores1 = scores+(mf_long)i*K;
+            for(mf_int j = 0; j < K; j++)
+            {
+                bool found = j < (mf_int)heap.size();
+                items1[j] = found ? heap[j].second : -1;
+                scores1[j] = found ? heap[j].first :
+                                     numeric_limits<mf_float>::quiet_NaN();
+            }
+        }
+    }
+}
+
+} // unnamed namespace
+
+void mf_predict_nodes(
+    mf_model const *model,
+    mf_node *R,
+    mf_long size,
+    mf_int by_user,
+    mf_int nr_threads)
+{
+    predict_nodes(model, R, size, by_user, nr_threads, mf_predict);
+}
+
+void mf_recommend(
+    mf_model const *model,
+    mf_int const *users,
+    mf_int nr_users,
+    mf_int K,
+    mf_problem const *exclude,
+    mf_int nr_threads,
+    mf_int *items,
+    mf_float *scores)
+{
+    const mf_int k = model->k;
+    auto dot_rows = kernels().dot_rows;
+    recommend_top(model->m, model->n, (mf_long)k*sizeof(mf_float), users,
+                  nr_users, K, exclude, nr_threads, items, scores,
+                  [=] (mf_int u, mf_int j0, mf_int j1, mf_float *out)
+                  {
+                      dot_rows(model->P+(mf_long)u*k, model->Q+(mf_long)j0*k,
+                               j1-j0, k, out);
+                  });
 }
 
 void mf_destroy_model(mf_model **model)
 {
     if(model == nullptr || *model == nullptr)
         return;
-#ifdef _WIN32
-    _aligned_free((*model)->P);
-    _aligned_free((*model)->Q);
-#elif defined(posix_memalign)
-    free((*model)->P);
-    free((*model)->Q);
-#else
-    Reco::free_aligned((*model)->P);
-    Reco::free_aligned((*model)->Q);
+    if((*model)->mapping != nullptr)
+    {
+        delete (Reco::MappedFile *)(*model)->mapping;
+        delete *model;
+        *model = nullptr;
+        return;
+    }
+    free_aligned_memory((*model)->P);
+    free_aligned_memory((*model)->Q);
+    delete *model;
+    *model = nullptr;
+}
+
+namespace
+{
+
+// Quantizes each of the nr_rows rows of A with a scale that maps its
+// largest magnitude to 127. Rows with a NaN or infinite value, which
+// diverged training leaves behind, get zeros and a NaN scale, so that
+// they predict NaN as they do in A.
+void quantize_rows(mf_float const *A, mf_long nr_rows, mf_int k,
+                   signed char *A_int8, mf_float *scales, mf_int nr_threads)
+{
+#if defined USEOMP
+#pragma omp parallel for schedule(static) num_threads(nr_threads)
 #endif
+    for(mf_long i = 0; i < nr_rows; i++)
+    {
+        mf_float const *a = A+i*k;
+        mf_float max_abs = 0;
+        bool finite = true;
+        for(mf_int d = 0; d < k; d++)
+        {
+            finite = finite && std::isfinite(a[d]);
+            max_abs = max(max_abs, abs(a[d]));
+        }
+
+        if(!finite)
+        {
+            fill(A_int8+i*k, A_int8+(i+1)*k, (signed char)0);
+            scales[i] = numeric_limits<mf_float>::quiet_NaN();
+            continue;
+        }
+
+        mf_float scale = max_abs/127;
+        mf_float inv_scale = scale > 0 ? 1/scale : 0;
+        for(mf_int d = 0; d < k; d++)
+            A_int8[i*k+d] = (signed char)lrint(a[d]*inv_scale);
+        scales[i] = scale;
+    }
+}
+
+mf_qmodel* load_qmodel_binary(Reco::MappedFile *file)
+{
+    QModelHeader header;
+    memcpy(&header, file->data(), sizeof(header));
+
+    mf_long p_scale_size = (mf_long)header.m*sizeof(mf_float);
+    mf_long q_scale_size = (mf_long)header.n*sizeof(mf_float);
+    mf_long p_size = (mf_long)header.m*header.k;
+    mf_long q_size = (mf_long)header.n*header.k;
+    if(header.version != kQModelVersion ||
+       header.m < 0 || header.n < 0 || header.k < 0 ||
+       header.p_scale_offset % kALIGNByte != 0 ||
+       header.q_scale_offset % kALIGNByte != 0 ||
+       header.p_scale_offset + p_scale_size > header.q_scale_offset ||
+       header.q_scale_offset + q_scale_size > header.p_offset ||
+       header.p_offset + p_size > header.q_offset ||
+       (mf_long)file->size() < header.q_offset + q_size)
+    {
+        delete file;
+        return nullptr;
+    }
+
+    mf_qmodel *model = new mf_qmodel;
+    model->m = header.m;
+    model->n = header.n;
+    model->k = header.k;
+    model->P_scale = (mf_float *)(file->data() + header.p_scale_offset);
+    model->Q_scale = (mf_float *)(file->data() + header.q_scale_offset);
+    model->P = (signed char *)(file->data() + header.p_offset);
+    model->Q = (signed char *)(file->data() + header.q_offset);
+    model->mapping = file;
+
+    return model;
+}
+
+} // unnamed namespace
+
+mf_qmodel* mf_quantize_model(mf_model const *model, mf_int nr_threads)
+{
+    mf_qmodel *qmodel = new mf_qmodel;
+    qmodel->m = model->m;
+    qmodel->n = model->n;
+    qmodel->k = model->k;
+    qmodel->mapping = nullptr;
+    qmodel->P = (signed char *)malloc_aligned_memory(
+        max((mf_long)model->m*model->k, (mf_long)1));
+    qmodel->Q = (signed char *)malloc_aligned_memory(
+        max((mf_long)model->n*model->k, (mf_long)1));
+    qmodel->P_scale = malloc_aligned_float(max(model->m, 1));
+    qmodel->Q_scale = malloc_aligned_float(max(model->n, 1));
+
+    quantize_rows(model->P, model->m, model->k, qmodel->P, qmodel->P_scale,
+                  nr_threads);
+    quantize_rows(model->Q, model->n, model->k, qmodel->Q, qmodel->Q_scale,
+                  nr_threads);
+
+    return qmodel;
+}
+
+mf_int mf_save_qmodel(mf_qmodel const *model, char const *path)
+{
+    auto align = [] (mf_long offset)
+    {
+        return (offset+kALIGNByte-1)/kALIGNByte*kALIGNByte;
+    };
+
+    mf_long p_scale_size = (mf_long)model->m*sizeof(mf_float);
+    mf_long q_scale_size = (mf_long)model->n*sizeof(mf_float);
+    mf_long p_size = (mf_long)model->m*model->k;
+    mf_long q_size = (mf_long)model->n*model->k;
+
+    QModelHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, kQModelMagic, sizeof(kQModelMagic));
+    header.version = kQModelVersion;
+    header.m = model->m;
+    header.n = model->n;
+    header.k = model->k;
+    header.p_scale_offset = sizeof(QModelHeader);
+    header.q_scale_offset = align(header.p_scale_offset + p_scale_size);
+    header.p_offset = align(header.q_scale_offset + q_scale_size);
+    header.q_offset = align(header.p_offset + p_size);
+
+    char const padding[kALIGNByte] = {0};
+    return save_replacing(path, [&] (ofstream &f)
+    {
+        f.write((char *)&header, sizeof(header));
+        f.write((char *)model->P_scale, p_scale_size);
+        f.write(padding,
+                header.q_scale_offset-header.p_scale_offset-p_scale_size);
+        f.write((char *)model->Q_scale, q_scale_size);
+        f.write(padding, header.p_offset-header.q_scale_offset-q_scale_size);
+        f.write((char *)model->P, p_size);
+        f.write(padding, header.q_offset-header.p_offset-p_size);
+        f.write((char *)model->Q, q_size);
+    });
+}
+
+mf_qmodel* mf_load_qmodel(char const *path)
+{
+    Reco::MappedFile *file = new Reco::MappedFile;
+    if(!file->open(path))
+    {
+        delete file;
+        return nullptr;
+    }
+
+    if(file->size() < sizeof(QModelHeader) ||
+       memcmp(file->data(), kQModelMagic, sizeof(kQModelMagic)) != 0)
+    {
+        delete file;
+        return nullptr;
+    }
+
+    return load_qmodel_binary(file);
+}
+
+void mf_destroy_qmodel(mf_qmodel **model)
+{
+    if(model == nullptr || *model == nullptr)
+        return;
+    if((*model)->mapping != nullptr)
+    {
+        delete (Reco::MappedFile *)(*model)->mapping;
+    }
+    else
+    {
+        free_aligned_memory((*model)->P);
+        free_aligned_memory((*model)->Q);
+        free_aligned_memory((*model)->P_scale);
+        free_aligned_memory((*model)->Q_scale);
+    }
     delete *model;
     *model = nullptr;
 }
 
+mf_float mf_qpredict(mf_qmodel const *model, mf_int u, mf_int v)
+{
+    if(u < 0 || u >= model->m || v < 0 || v >= model->n)
+        return 0.0f;
+
+    signed char *p = model->P+(mf_long)u*model->k;
+    signed char *q = model->Q+(mf_long)v*model->k;
+
+    return model->P_scale[u]*model->Q_scale[v]*
+           (mf_float)kernels().dot_int8(p, q, model->k);
+}
+
+void mf_qpredict_nodes(
+    mf_qmodel const *model,
+    mf_node *R,
+    mf_long size,
+    mf_int by_user,
+    mf_int nr_threads)
+{
+    predict_nodes(model, R, size, by_user, nr_threads, mf_qpredict);
+}
+
+void mf_qrecommend(
+    mf_qmodel const *model,
+    mf_int const *users,
+    mf_int nr_users,
+    mf_int K,
+    mf_problem const *exclude,
+    mf_int nr_threads,
+    mf_int *items,
+    mf_float *scores)
+{
+    const mf_int k = model->k;
+    auto dot_int8 = kernels().dot_int8;
+    recommend_top(model->m, model->n, max(k, 1), users, nr_users, K,
+                  exclude, nr_threads, items, scores,
+                  [=] (mf_int u, mf_int j0, mf_int j1, mf_float *out)
+                  {
+                      signed char const *p = model->P+(mf_long)u*k;
+                      for(mf_int j = j0; j < j1; j++)
+                          out[j-j0] = model->P_scale[u]*model->Q_scale[j]*
+                                      (mf_float)dot_int8(
+                                          p, model->Q+(mf_long)j*k, k);
+                  });
+}
+
 mf_parameter mf_get_default_param()
 {
     mf_parameter param;
@@ -1468,8 +3934,33 @@ mf_parameter mf_get_default_param()
     param.do_implicit = false;
     param.quiet = false;
     param.copy_data = true;
+    param.precision = MF_FP32;
+    param.prefetch = -1;
+    param.numa = false;
+    param.deterministic = false;
 
     return param;
 }
 
+char const* mf_simd_kernel()
+{
+    return kernels().name;
+}
+
+mf_float mf_dot(mf_float const *p, mf_float const *q, mf_int k)
+{
+    return kernels().dot_product(p, q, k);
+}
+
+mf_float mf_sqnorm(mf_float const *p, mf_int k)
+{
+    return kernels().squared_norm(p, k);
+}
+
+void mf_dot_rows(mf_float const *p, mf_float const *Q, mf_int n, mf_int k,
+                 mf_float *products)
+{
+    kernels().dot_rows(p, Q, n, k, products);
+}
+
 } // namespace mf
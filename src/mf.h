@@ -30,6 +30,27 @@ struct mf_problem
     struct mf_node *R;
 };
 
+// A training set that stays on disk: nnz mf_node records stored back to
+// back in the file at path, starting at byte offset
+struct mf_disk_problem
+{
+    mf_int m;
+    mf_int n;
+    mf_long nnz;
+    char const *path;
+    mf_long offset;
+};
+
+// Storage of P and Q during training. With MF_BF16 and MF_FP16 the factors
+// are held as 16-bit bfloat16 or IEEE half values through the iterations,
+// and widened to floats for the arithmetic and in the trained model.
+enum
+{
+    MF_FP32 = 0,
+    MF_BF16 = 1,
+    MF_FP16 = 2
+};
+
 struct mf_parameter
 {
     mf_int k; 
@@ -43,6 +64,10 @@ struct mf_parameter
     mf_int do_implicit; // flag for implicit feedback
     mf_int quiet; 
     mf_int copy_data;
+    mf_int precision; // MF_FP32, MF_BF16 or MF_FP16
+    mf_int prefetch; // ratings ahead to prefetch rows for, -1 to choose from k
+    mf_int numa; // pin threads and place the data they use on NUMA nodes
+    mf_int deterministic; // train blocks in a fixed order drawn from the seed
 };
 
 struct mf_parameter mf_get_default_param();
@@ -54,11 +79,35 @@ struct mf_model
     mf_int k;
     mf_float *P;
     mf_float *Q;
+    void *mapping; // file mapping that P and Q point into, if any
 };
 
+// A model with P and Q quantized to 8-bit integers for scoring. Each row
+// holds k signed bytes and a scale, so that entry d of row u of P is about
+// P_scale[u]*P[u*k+d], and likewise for Q.
+struct mf_qmodel
+{
+    mf_int m;
+    mf_int n;
+    mf_int k;
+    signed char *P;
+    signed char *Q;
+    mf_float *P_scale;
+    mf_float *Q_scale;
+    void *mapping; // file mapping that the arrays point into, if any
+};
+
+// Saves the model in the binary format, which mf_load_model() maps into
+// memory instead of parsing
 mf_int mf_save_model(struct mf_model const *model, char const *path);
 
-struct mf_model* mf_load_model(char const *path);
+// Saves the model in the LIBMF text format, formatted by nr_threads threads
+mf_int mf_save_model_text(struct mf_model const *model, char const *path,
+                          mf_int nr_threads);
+
+// Loads a model saved in either format. A text model is parsed by
+// nr_threads threads, a binary one is mapped.
+struct mf_model* mf_load_model(char const *path, mf_int nr_threads);
 
 void mf_destroy_model(struct mf_model **model);
 
@@ -71,6 +120,26 @@ struct mf_model* mf_train_with_validation(
     struct mf_problem const *va, 
     struct mf_parameter param);
 
+// Like mf_train_with_validation(), but calls release(arg) as soon as tr is
+// no longer read, so that its memory can be freed during training. That
+// is once it has been packed into compact blocks; if it cannot be packed,
+// tr is read until the end and release is not called.
+struct mf_model* mf_train_with_release(
+    struct mf_problem const *tr,
+    struct mf_problem const *va,
+    struct mf_parameter param,
+    void (*release)(void *),
+    void *arg);
+
+// Trains without loading the training set into memory. The grid blocks
+// are written to a temporary file at block_path, which is removed after
+// training, and are read back block by block during the iterations.
+struct mf_model* mf_train_on_disk(
+    struct mf_disk_problem const *tr,
+    struct mf_problem const *va,
+    struct mf_parameter param,
+    char const *block_path);
+
 mf_float mf_cross_validation(
     struct mf_problem const *prob, 
     mf_int nr_folds, 
@@ -78,6 +147,85 @@ mf_float mf_cross_validation(
 
 mf_float mf_predict(struct mf_model const *model, mf_int p_idx, mf_int q_idx);
 
+// Predicts the ratings of the size (u, v) pairs in R on nr_threads
+// threads, storing them in the r fields. With by_user set, the pairs are
+// visited grouped by user, so that each row of P is loaded once.
+void mf_predict_nodes(
+    struct mf_model const *model,
+    struct mf_node *R,
+    mf_long size,
+    mf_int by_user,
+    mf_int nr_threads);
+
+// Finds the K items with the highest predicted ratings for each of the
+// nr_users users. Row i of the nr_users x K arrays items and scores
+// receives the items of users[i] in decreasing order of score. Items
+// rated in exclude, if not null, are skipped. Unknown users and missing
+// items are reported as item -1 with a NaN score.
+void mf_recommend(
+    struct mf_model const *model,
+    mf_int const *users,
+    mf_int nr_users,
+    mf_int K,
+    struct mf_problem const *exclude,
+    mf_int nr_threads,
+    mf_int *items,
+    mf_float *scores);
+
+// Quantizes the factors of the model to int8, with one scale per row that
+// maps the largest magnitude of the row to 127. Rows that are not finite
+// are zeroed and get a NaN scale.
+struct mf_qmodel* mf_quantize_model(
+    struct mf_model const *model,
+    mf_int nr_threads);
+
+// Saves the int8 model in a binary format that mf_load_qmodel() maps into
+// memory
+mf_int mf_save_qmodel(struct mf_qmodel const *model, char const *path);
+
+struct mf_qmodel* mf_load_qmodel(char const *path);
+
+void mf_destroy_qmodel(struct mf_qmodel **model);
+
+// Counterparts of mf_predict(), mf_predict_nodes() and mf_recommend() for
+// int8 models
+mf_float mf_qpredict(struct mf_qmodel const *model, mf_int p_idx, mf_int q_idx);
+
+void mf_qpredict_nodes(
+    struct mf_qmodel const *model,
+    struct mf_node *R,
+    mf_long size,
+    mf_int by_user,
+    mf_int nr_threads);
+
+void mf_qrecommend(
+    struct mf_qmodel const *model,
+    mf_int const *users,
+    mf_int nr_users,
+    mf_int K,
+    struct mf_problem const *exclude,
+    mf_int nr_threads,
+    mf_int *items,
+    mf_float *scores);
+
+// Name of the SIMD kernels chosen for this CPU: "generic", "sse", "avx2"
+// or "avx512"
+char const* mf_simd_kernel();
+
+// Dot product and squared norm of rows of k floats of any alignment, with
+// the SIMD kernels of mf_simd_kernel()
+mf_float mf_dot(mf_float const *p, mf_float const *q, mf_int k);
+
+mf_float mf_sqnorm(mf_float const *p, mf_int k);
+
+// The dot products of p with the n consecutive rows of k floats at Q
+void mf_dot_rows(
+    mf_float const *p,
+    mf_float const *Q,
+    mf_int n,
+    mf_int k,
+    mf_float *products);
+
 #ifdef __cplusplus
 } // namespace mf
 
@@ -0,0 +1,374 @@
+#include <string>
+#include <fstream>
+#include <iostream>
+#include <cstring>
+#include <stdexcept>
+#include <algorithm>
+#include <vector>
+
+#include <Rcpp.h>
+
+#include "mf.h"
+#include "reco-data.h"
+#include "reco-text.h"
+
+// _OPENMP will be defined if OpenMP is enabled,
+// so we can detect this automatically
+#ifdef _OPENMP
+  #ifndef USEOMP
+    #define USEOMP
+  #endif
+#endif
+
+#if defined USEOMP
+#include <omp.h>
+#endif
+
+using namespace mf;
+
+namespace Reco
+{
+
+static_assert(sizeof(BinaryHeader) == 64, "unexpected binary header size");
+
+namespace
+{
+
+// Finalizer of splitmix64, mixing the bits of one node with its position
+inline unsigned long long mix_node(mf_node const &N, mf_long i)
+{
+    unsigned int r;
+    std::memcpy(&r, &N.r, sizeof(r));
+
+    unsigned long long x = ((unsigned long long)(unsigned int)N.u << 32) |
+                           (unsigned int)N.v;
+    x ^= ((unsigned long long)r << 17) + (unsigned long long)i*0x9e3779b97f4a7c15ULL;
+    x = (x ^ (x >> 30))*0xbf58476d1ce4e5b9ULL;
+    x = (x ^ (x >> 27))*0x94d049bb133111ebULL;
+    return x ^ (x >> 31);
+}
+
+// Parses the lines in [begin, end) as "row col value" triplets. Lines
+// that do not start with such a triplet are skipped. min_index receives
+// the smallest row or column index if it is negative.
+void parse_lines(const char *begin, const char *end,
+                 std::vector<mf_node> &nodes, mf_int &m, mf_int &n,
+                 mf_int &min_index)
+{
+    mf_node N;
+    for(const char *p = begin; p != end;)
+    {
+        const char *eol = next_line(p, end);
+
+        const char *s = p;
+        if(parse_int(s, eol, N.u) && parse_int(s, eol, N.v) &&
+           parse_float(s, eol, N.r))
+        {
+            if(N.u+1 > m)
+                m = N.u+1;
+            if(N.v+1 > n)
+                n = N.v+1;
+            min_index = std::min(min_index, std::min(N.u, N.v));
+            nodes.push_back(N);
+        }
+
+        p = eol;
+    }
+}
+
+// Splits [begin, end) into one range of whole lines per thread and parses
+// them in parallel. Each range keeps its own nodes and maxima of the
+// indices, so the threads never synchronize.
+void parse_parallel(const char *begin, const char *end, mf_int nr_threads,
+                    std::vector<std::vector<mf_node>> &chunks,
+                    mf_int &m, mf_int &n)
+{
+    mf_int nr_chunks = nr_threads;
+    std::vector<const char *> bounds = split_lines(begin, end, nr_chunks);
+
+    chunks.assign(nr_chunks, std::vector<mf_node>());
+    std::vector<mf_int> ms(nr_chunks, 0), ns(nr_chunks, 0);
+    std::vector<mf_int> min_indices(nr_chunks, 0);
+
+#if defined USEOMP
+#pragma omp parallel for schedule(static, 1) num_threads(nr_threads)
+#endif
+    for(mf_int i = 0; i < nr_chunks; i++)
+        parse_lines(bounds[i], bounds[i+1], chunks[i], ms[i], ns[i],
+                    min_indices[i]);
+
+    if(*std::min_element(min_indices.begin(), min_indices.end()) < 0)
+        throw std::invalid_argument("user and item indices should not be negative");
+
+    m = std::max(m, *std::max_element(ms.begin(), ms.end()));
+    n = std::max(n, *std::max_element(ns.begin(), ns.end()));
+}
+
+void read_text(const std::string &path, mf_int nr_threads, ProblemData &data)
+{
+    MappedFile file;
+    if(!file.open(path))
+        throw std::runtime_error("cannot open " + path);
+    file.advise_sequential();
+
+    mf_problem &prob = data.prob;
+    std::vector<std::vector<mf_node>> chunks;
+    parse_parallel(file.data(), file.data() + file.size(), nr_threads,
+                   chunks, prob.m, prob.n);
+
+    std::vector<mf_long> offsets(chunks.size()+1, 0);
+    for(std::size_t i = 0; i < chunks.size(); i++)
+        offsets[i+1] = offsets[i] + chunks[i].size();
+
+    data.nodes.resize(offsets.back());
+
+#if defined USEOMP
+#pragma omp parallel for schedule(static, 1) num_threads(nr_threads)
+#endif
+    for(mf_int i = 0; i < (mf_int)chunks.size(); i++)
+    {
+        std::copy(chunks[i].begin(), chunks[i].end(),
+                  data.nodes.begin() + offsets[i]);
+        std::vector<mf_node>().swap(chunks[i]);
+    }
+
+    prob.nnz = data.nodes.size();
+    prob.R = data.nodes.empty() ? nullptr : data.nodes.data();
+}
+
+void check_header(const std::string &path, BinaryHeader const &header,
+                  std::size_t file_size)
+{
+    if(header.version != kBinaryVersion ||
+       header.node_size != (mf_int)sizeof(mf_node))
+        throw std::runtime_error(path + " was written by an incompatible version");
+
+    if(header.nnz < 0 ||
+       file_size != sizeof(BinaryHeader) + header.nnz*sizeof(mf_node))
+        throw std::runtime_error(path + " is truncated");
+}
+
+void read_binary(const std::string &path, mf_int nr_threads, ProblemData &data)
+{
+    if(!data.file.open(path))
+        throw std::runtime_error("cannot open " + path);
+
+    if(data.file.size() < sizeof(BinaryHeader))
+        throw std::runtime_error(path + " is truncated");
+
+    BinaryHeader header;
+    std::memcpy(&header, data.file.data(), sizeof(header));
+    check_header(path, header, data.file.size());
+
+    mf_node *R = (mf_node *)(data.file.data() + sizeof(BinaryHeader));
+
+    if(node_checksum(R, header.nnz, nr_threads) != header.checksum)
+        throw std::runtime_error("checksum mismatch in " + path);
+
+    data.prob.m = header.m;
+    data.prob.n = header.n;
+    data.prob.nnz = header.nnz;
+    data.prob.R = header.nnz > 0 ? R : nullptr;
+}
+
+} // unnamed namespace
+
+ProblemData::ProblemData()
+{
+    prob.m = 0;
+    prob.n = 0;
+    prob.nnz = 0;
+    prob.R = nullptr;
+}
+
+void ProblemData::release()
+{
+    std::vector<mf_node>().swap(nodes);
+    file.close();
+    prob.nnz = 0;
+    prob.R = nullptr;
+}
+
+unsigned long long node_checksum(mf_node const *R, mf_long nnz,
+                                 mf_int nr_threads)
+{
+    // A sum of position-dependent hashes, so that it can be computed
+    // in parallel and incrementally by the converter
+    unsigned long long sum = 0;
+#if defined USEOMP
+#pragma omp parallel for schedule(static) reduction(+:sum) num_threads(nr_threads)
+#endif
+    for(mf_long i = 0; i < nnz; i++)
+        sum += mix_node(R[i], i);
+
+    return sum;
+}
+
+bool is_binary_file(const std::string &path)
+{
+    std::ifstream f(path, std::ios::binary);
+    char magic[sizeof(kBinaryMagic)];
+    if(!f.read(magic, sizeof(magic)))
+        return false;
+
+    return std::memcmp(magic, kBinaryMagic, sizeof(magic)) == 0;
+}
+
+void read_binary_header(const std::string &path, BinaryHeader &header)
+{
+    std::ifstream f(path, std::ios::binary | std::ios::ate);
+    if(!f.is_open())
+        throw std::runtime_error("cannot open " + path);
+
+    std::size_t file_size = f.tellg();
+    f.seekg(0);
+    if(!f.read((char *)&header, sizeof(header)))
+        throw std::runtime_error(path + " is truncated");
+
+    check_header(path, header, file_size);
+}
+
+void read_problem(const std::string &path, mf_int nr_threads,
+                  ProblemData &data)
+{
+    if(path.empty())
+        return;
+
+    if(is_binary_file(path))
+        read_binary(path, nr_threads, data);
+    else
+        read_text(path, nr_threads, data);
+}
+
+void read_problem(int const *user, int const *item, double const *rating,
+                  mf_long nnz, mf_int nr_threads, ProblemData &data)
+{
+    // The node array is the only copy of the data made here: libmf
+    // shuffles and scales the nodes in place, so it cannot work on the
+    // vectors of R directly, and it is passed on with copy_data off
+    data.nodes.resize(nnz);
+    mf_node *R = data.nodes.data();
+
+    mf_int m = 0, n = 0, min_index = 0;
+#if defined USEOMP
+#pragma omp parallel for schedule(static) reduction(max:m,n) reduction(min:min_index) num_threads(nr_threads)
+#endif
+    for(mf_long i = 0; i < nnz; i++)
+    {
+        R[i].u = user[i];
+        R[i].v = item[i];
+        R[i].r = (mf_float)rating[i];
+        m = std::max(m, user[i]+1);
+        n = std::max(n, item[i]+1);
+        min_index = std::min(min_index, std::min(user[i], item[i]));
+    }
+
+    if(min_index < 0)
+        throw std::invalid_argument("user and item indices should not be negative");
+
+    data.prob.m = m;
+    data.prob.n = n;
+    data.prob.nnz = nnz;
+    data.prob.R = nnz > 0 ? R : nullptr;
+}
+
+void read_problem(SEXP data_, mf_int nr_threads, ProblemData &data)
+{
+    if(Rf_isString(data_))
+    {
+        read_problem(Rcpp::as<std::string>(data_), nr_threads, data);
+        return;
+    }
+
+    Rcpp::List vectors(data_);
+    Rcpp::IntegerVector user = vectors["user"];
+    Rcpp::IntegerVector item = vectors["item"];
+    Rcpp::NumericVector rating = vectors["rating"];
+    if(item.length() != user.length() || rating.length() != user.length())
+        throw std::invalid_argument("user, item and rating columns should have the same length");
+
+    read_problem(user.begin(), item.begin(), rating.begin(), user.length(),
+                 nr_threads, data);
+}
+
+void convert_to_binary(const std::string &text_path,
+                       const std::string &bin_path,
+                       mf_int nr_threads)
+{
+    MappedFile fin;
+    if(!fin.open(text_path))
+        throw std::runtime_error("cannot open " + text_path);
+    fin.advise_sequential();
+
+    std::ofstream fout(bin_path, std::ios::binary);
+    if(!fout.is_open())
+        throw std::runtime_error("cannot write " + bin_path);
+
+    BinaryHeader header;
+    std::memset(&header, 0, sizeof(header));
+    std::memcpy(header.magic, kBinaryMagic, sizeof(kBinaryMagic));
+    header.version = kBinaryVersion;
+    header.node_size = sizeof(mf_node);
+
+    // Placeholder, rewritten once m, n, nnz and the checksum are known
+    fout.write((char *)&header, sizeof(header));
+
+    // The text is parsed in windows of whole lines, so that the nodes
+    // of only one window are held in memory at a time
+    const std::size_t window_size = (std::size_t)nr_threads << 25;
+    const char *end = fin.data() + fin.size();
+    std::vector<std::vector<mf_node>> chunks;
+    for(const char *begin = fin.data(); begin != end;)
+    {
+        const char *stop = end;
+        if((std::size_t)(end - begin) > window_size)
+            stop = next_line(begin + window_size - 1, end);
+
+        parse_parallel(begin, stop, nr_threads, chunks, header.m, header.n);
+
+        std::vector<mf_long> offsets(chunks.size()+1, header.nnz);
+        for(std::size_t i = 0; i < chunks.size(); i++)
+            offsets[i+1] = offsets[i] + chunks[i].size();
+
+        unsigned long long checksum = 0;
+#if defined USEOMP
+#pragma omp parallel for schedule(static, 1) reduction(+:checksum) num_threads(nr_threads)
+#endif
+        for(mf_int i = 0; i < (mf_int)chunks.size(); i++)
+            for(std::size_t j = 0; j < chunks[i].size(); j++)
+                checksum += mix_node(chunks[i][j], offsets[i] + j);
+
+        for(std::size_t i = 0; i < chunks.size(); i++)
+            fout.write((char *)chunks[i].data(), chunks[i].size()*sizeof(mf_node));
+
+        header.checksum += checksum;
+        header.nnz = offsets.back();
+        begin = stop;
+    }
+
+    fout.seekp(0);
+    fout.write((char *)&header, sizeof(header));
+
+    if(!fout)
+        throw std::runtime_error("cannot write " + bin_path);
+}
+
+
+} // namespace Reco
+
+RcppExport SEXP reco_convert_data(SEXP text_path_, SEXP bin_path_, SEXP nthread_)
+{
+BEGIN_RCPP
+
+    std::string text_path = Rcpp::as<std::string>(text_path_);
+    std::string bin_path = Rcpp::as<std::string>(bin_path_);
+    mf_int nr_threads = Rcpp::as<mf_int>(nthread_);
+    if(nr_threads <= 0)
+        throw std::invalid_argument("number of threads should be greater than zero");
+
+    Reco::convert_to_binary(text_path, bin_path, nr_threads);
+
+    return R_NilValue;
+
+END_RCPP
+}
@@ -0,0 +1,84 @@
+#ifndef RECO_DATA_H
+#define RECO_DATA_H
+
+#include <string>
+#include <vector>
+
+#include <Rcpp.h>
+
+#include "mf.h"
+#include "reco-mmap.h"
+
+namespace Reco
+{
+
+// Layout of the binary rating file. The header is followed by nnz
+// mf_node records in native byte order, so that the node array can be
+// handed to libmf straight from a memory mapping.
+struct BinaryHeader
+{
+    char magic[8];
+    mf::mf_int version;
+    mf::mf_int node_size;
+    mf::mf_int m;
+    mf::mf_int n;
+    mf::mf_long nnz;
+    unsigned long long checksum;
+    char reserved[24];
+};
+
+const char kBinaryMagic[8] = {'R', 'E', 'C', 'O', 'B', 'I', 'N', '\0'};
+const mf::mf_int kBinaryVersion = 1;
+
+// Owns the memory behind an mf_problem, which is either a parsed copy
+// of a text file or a mapping of a binary file
+class ProblemData
+{
+public:
+    ProblemData();
+
+    // Frees the nodes, once the training set is no longer read
+    void release();
+
+    mf::mf_problem prob;
+    std::vector<mf::mf_node> nodes;
+    MappedFile file;
+
+private:
+    ProblemData(const ProblemData &);
+    ProblemData &operator=(const ProblemData &);
+};
+
+// Checksum stored in the binary header, computed over the node records
+unsigned long long node_checksum(mf::mf_node const *R, mf::mf_long nnz,
+                                 mf::mf_int nr_threads);
+
+// Whether the file starts with the binary header magic
+bool is_binary_file(const std::string &path);
+
+// Reads and checks the header of a binary rating file, without touching
+// the node records
+void read_binary_header(const std::string &path, BinaryHeader &header);
+
+// Reads a rating file in either text or binary format. An empty path
+// gives an empty problem.
+void read_problem(const std::string &path, mf::mf_int nr_threads,
+                  ProblemData &data);
+
+// Builds the problem from nnz user indices, item indices and ratings
+void read_problem(int const *user, int const *item, double const *rating,
+                  mf::mf_long nnz, mf::mf_int nr_threads, ProblemData &data);
+
+// Reads the data passed from R, which is either the path to a rating file
+// or a list of user, item and rating vectors
+void read_problem(SEXP data_, mf::mf_int nr_threads, ProblemData &data);
+
+// Converts a text rating file into the binary format
+void convert_to_binary(const std::string &text_path,
+                       const std::string &bin_path,
+                       mf::mf_int nr_threads);
+
+
+} // namespace Reco
+
+#endif // RECO_DATA_H
@@ -0,0 +1,449 @@
+#include <string>
+#include <fstream>
+#include <cmath>
+#include <cstring>
+#include <limits>
+#include <stdexcept>
+#include <algorithm>
+#include <functional>
+#include <vector>
+
+#include <Rcpp.h>
+
+#include "mf.h"
+#include "reco-index.h"
+#include "reco-model.h"
+#include "reco-utils.h"
+
+// _OPENMP will be defined if OpenMP is enabled,
+// so we can detect this automatically
+#ifdef _OPENMP
+  #ifndef USEOMP
+    #define USEOMP
+  #endif
+#endif
+
+#if defined USEOMP
+#include <omp.h>
+#endif
+
+using namespace mf;
+
+namespace Reco
+{
+
+static_assert(sizeof(IndexHeader) == 64, "unexpected index header size");
+
+namespace
+{
+
+// Number of k-means iterations, and sample points per list used to fit
+// the centroids
+const mf_int kKmeansIters = 10;
+const mf_int kSamplesPerList = 64;
+
+// The item in the augmented space: (q/M, sqrt(1-|q|^2/M^2))
+void augment(mf_float const *q, mf_int k, mf_float max_norm, mf_float *x)
+{
+    for(mf_int d = 0; d < k; d++)
+        x[d] = q[d]/max_norm;
+    x[k] = std::sqrt(std::max(1-mf_sqnorm(x, k), (mf_float)0));
+}
+
+// Nearest centroid of an augmented point. Minimizing |x-c|^2 is the same
+// as maximizing x.c-|c|^2/2.
+mf_int nearest(mf_float const *x, std::vector<mf_float> const &centroids,
+               std::vector<mf_float> const &half_sqnorms, mf_int dim)
+{
+    mf_int nr_lists = (mf_int)half_sqnorms.size();
+    std::vector<mf_float> products(nr_lists);
+    mf_dot_rows(x, centroids.data(), nr_lists, dim, products.data());
+
+    mf_int best = 0;
+    mf_float best_score = -std::numeric_limits<mf_float>::max();
+    for(mf_int l = 0; l < nr_lists; l++)
+    {
+        mf_float score = products[l]-half_sqnorms[l];
+        if(score > best_score)
+        {
+            best_score = score;
+            best = l;
+        }
+    }
+    return best;
+}
+
+// Checksum of the item factors of a model, which tells whether an index
+// was built from them
+unsigned long long model_checksum_of(mf_model const *model)
+{
+    unsigned long long h = 14695981039346656037ULL;
+    mf_long size = (mf_long)model->n*model->k;
+    for(mf_long i = 0; i < size; i++)
+    {
+        unsigned int bits;
+        std::memcpy(&bits, model->Q+i, sizeof(bits));
+        h = (h ^ bits)*1099511628211ULL;
+    }
+    return h;
+}
+
+void half_sqnorms_of(std::vector<mf_float> const &centroids, mf_int dim,
+                     std::vector<mf_float> &half_sqnorms)
+{
+    for(mf_int l = 0; l < (mf_int)half_sqnorms.size(); l++)
+    {
+        mf_float const *c = centroids.data()+(mf_long)l*dim;
+        half_sqnorms[l] = mf_sqnorm(c, dim)/2;
+    }
+}
+
+} // unnamed namespace
+
+void ItemIndex::build(mf_model const *model, mf_int nr_lists_,
+                      mf_int nr_threads)
+{
+    n = model->n;
+    k = model->k;
+    if(n == 0)
+        throw std::invalid_argument("the model has no items");
+    model_checksum = model_checksum_of(model);
+
+    nr_lists = nr_lists_ > 0 ? nr_lists_ : (mf_int)std::ceil(std::sqrt((double)n));
+    nr_lists = std::min(nr_lists, n);
+
+    const mf_int dim = k+1;
+
+    max_norm = 0;
+#if defined USEOMP
+#pragma omp parallel for schedule(static) reduction(max:max_norm) num_threads(nr_threads)
+#endif
+    for(mf_int j = 0; j < n; j++)
+    {
+        mf_float const *q = model->Q+(mf_long)j*k;
+        max_norm = std::max(max_norm, std::sqrt(mf_sqnorm(q, k)));
+    }
+    if(max_norm == 0)
+        max_norm = 1;
+
+    // Fit the centroids on a random sample of the items, starting from
+    // the first nr_lists of them
+    mf_int nr_samples = (mf_int)std::min((mf_long)n, (mf_long)nr_lists*kSamplesPerList);
+    std::vector<mf_int> order(n);
+    for(mf_int j = 0; j < n; j++)
+        order[j] = j;
+    for(mf_int i = 0; i < nr_samples; i++)
+        std::swap(order[i], order[i+rand_less_than(n-i)]);
+
+    std::vector<mf_float> samples((mf_long)nr_samples*dim);
+    for(mf_int i = 0; i < nr_samples; i++)
+        augment(model->Q+(mf_long)order[i]*k, k, max_norm,
+                samples.data()+(mf_long)i*dim);
+
+    centroids.assign(samples.begin(), samples.begin()+(mf_long)nr_lists*dim);
+    std::vector<mf_float> half_sqnorms(nr_lists);
+    std::vector<mf_int> assignment(nr_samples);
+
+    for(mf_int iter = 0; iter < kKmeansIters; iter++)
+    {
+        half_sqnorms_of(centroids, dim, half_sqnorms);
+
+#if defined USEOMP
+#pragma omp parallel for schedule(static) num_threads(nr_threads)
+#endif
+        for(mf_int i = 0; i < nr_samples; i++)
+            assignment[i] = nearest(samples.data()+(mf_long)i*dim, centroids,
+                                    half_sqnorms, dim);
+
+        std::vector<mf_double> sums((mf_long)nr_lists*dim, 0);
+        std::vector<mf_int> counts(nr_lists, 0);
+        for(mf_int i = 0; i < nr_samples; i++)
+        {
+            mf_double *sum = sums.data()+(mf_long)assignment[i]*dim;
+            mf_float const *x = samples.data()+(mf_long)i*dim;
+            for(mf_int d = 0; d < dim; d++)
+                sum[d] += x[d];
+            counts[assignment[i]]++;
+        }
+
+        // Empty lists restart from a random sample point
+        for(mf_int l = 0; l < nr_lists; l++)
+        {
+            mf_float *c = centroids.data()+(mf_long)l*dim;
+            if(counts[l] == 0)
+            {
+                mf_float const *x = samples.data() +
+                                    (mf_long)rand_less_than(nr_samples)*dim;
+                std::copy(x, x+dim, c);
+                continue;
+            }
+            for(mf_int d = 0; d < dim; d++)
+                c[d] = (mf_float)(sums[(mf_long)l*dim+d]/counts[l]);
+        }
+    }
+
+    // Assign every item to its list, then group the item ids by list
+    half_sqnorms_of(centroids, dim, half_sqnorms);
+    std::vector<mf_int> lists(n);
+#if defined USEOMP
+#pragma omp parallel num_threads(nr_threads)
+#endif
+    {
+        std::vector<mf_float> x(dim);
+#if defined USEOMP
+#pragma omp for schedule(static)
+#endif
+        for(mf_int j = 0; j < n; j++)
+        {
+            augment(model->Q+(mf_long)j*k, k, max_norm, x.data());
+            lists[j] = nearest(x.data(), centroids, half_sqnorms, dim);
+        }
+    }
+
+    offsets.assign(nr_lists+1, 0);
+    for(mf_int j = 0; j < n; j++)
+        offsets[lists[j]+1]++;
+    for(mf_int l = 0; l < nr_lists; l++)
+        offsets[l+1] += offsets[l];
+
+    list_items.resize(n);
+    std::vector<mf_long> pos(offsets.begin(), offsets.end()-1);
+    for(mf_int j = 0; j < n; j++)
+        list_items[pos[lists[j]]++] = j;
+}
+
+void ItemIndex::save(const std::string &path) const
+{
+    std::ofstream f(path, std::ios::binary);
+    if(!f.is_open())
+        throw std::runtime_error("cannot write " + path);
+
+    IndexHeader header;
+    std::memset(&header, 0, sizeof(header));
+    std::memcpy(header.magic, kIndexMagic, sizeof(kIndexMagic));
+    header.version = kIndexVersion;
+    header.n = n;
+    header.k = k;
+    header.nr_lists = nr_lists;
+    header.max_norm = max_norm;
+    header.model_checksum = model_checksum;
+
+    f.write((char *)&header, sizeof(header));
+    f.write((char *)centroids.data(), centroids.size()*sizeof(mf_float));
+    f.write((char *)offsets.data(), offsets.size()*sizeof(mf_long));
+    f.write((char *)list_items.data(), list_items.size()*sizeof(mf_int));
+
+    if(!f)
+        throw std::runtime_error("cannot write " + path);
+}
+
+void ItemIndex::load(const std::string &path, mf_model const *model)
+{
+    std::ifstream f(path, std::ios::binary);
+    if(!f.is_open())
+        throw std::runtime_error("cannot open " + path);
+
+    IndexHeader header;
+    if(!f.read((char *)&header, sizeof(header)) ||
+       std::memcmp(header.magic, kIndexMagic, sizeof(kIndexMagic)) != 0 ||
+       header.version != kIndexVersion)
+        throw std::runtime_error(path + " is not an index file");
+
+    if(header.n != model->n || header.k != model->k ||
+       header.model_checksum != model_checksum_of(model))
+        throw std::runtime_error(path + " was built for a different model");
+
+    if(header.nr_lists < 1 || header.nr_lists > header.n)
+        throw std::runtime_error(path + " is corrupted");
+
+    n = header.n;
+    k = header.k;
+    nr_lists = header.nr_lists;
+    max_norm = header.max_norm;
+    model_checksum = header.model_checksum;
+
+    centroids.resize((mf_long)nr_lists*(k+1));
+    offsets.resize(nr_lists+1);
+    list_items.resize(n);
+
+    f.read((char *)centroids.data(), centroids.size()*sizeof(mf_float));
+    f.read((char *)offsets.data(), offsets.size()*sizeof(mf_long));
+    f.read((char *)list_items.data(), list_items.size()*sizeof(mf_int));
+
+    if(!f)
+        throw std::runtime_error(path + " is truncated");
+
+    // search() reads the lists and the items through these without checks
+    bool valid = offsets.front() == 0 && offsets.back() == n &&
+                 std::is_sorted(offsets.begin(), offsets.end());
+    for(mf_int j = 0; valid && j < n; j++)
+        valid = list_items[j] >= 0 && list_items[j] < n;
+    if(!valid)
+        throw std::runtime_error(path + " is corrupted");
+}
+
+void ItemIndex::search(mf_model const *model, mf_float const *p,
+                       mf_int K, mf_int nr_probes,
+                       mf_int const *ex_begin, mf_int const *ex_end,
+                       mf_int *items, mf_float *scores) const
+{
+    typedef std::pair<mf_float, mf_int> Candidate;
+    const mf_int dim = k+1;
+
+    // Lists in order of the distance of their centroids to (p/|p|, 0)
+    mf_float norm = std::sqrt(mf_sqnorm(p, k));
+    if(norm == 0)
+        norm = 1;
+
+    std::vector<Candidate> lists(nr_lists);
+    for(mf_int l = 0; l < nr_lists; l++)
+    {
+        mf_float const *c = centroids.data()+(mf_long)l*dim;
+        lists[l] = Candidate(mf_dot(p, c, k)/norm - mf_sqnorm(c, dim)/2, l);
+    }
+    nr_probes = std::min(std::max(nr_probes, 1), nr_lists);
+    std::partial_sort(lists.begin(), lists.begin()+nr_probes, lists.end(),
+                      std::greater<Candidate>());
+
+    std::vector<Candidate> heap;
+    heap.reserve(K);
+    for(mf_int i = 0; i < nr_probes; i++)
+    {
+        mf_int l = lists[i].second;
+        for(mf_long pos = offsets[l]; pos < offsets[l+1]; pos++)
+        {
+            mf_int j = list_items[pos];
+            if(ex_begin != ex_end && std::binary_search(ex_begin, ex_end, j))
+                continue;
+
+            mf_float score = mf_dot(p, model->Q+(mf_long)j*k, k);
+            if((mf_int)heap.size() < K)
+            {
+                heap.push_back(Candidate(score, j));
+                std::push_heap(heap.begin(), heap.end(), std::greater<Candidate>());
+            }
+            else if(score > heap.front().first)
+            {
+                std::pop_heap(heap.begin(), heap.end(), std::greater<Candidate>());
+                heap.back() = Candidate(score, j);
+                std::push_heap(heap.begin(), heap.end(), std::greater<Candidate>());
+            }
+        }
+    }
+
+    std::sort_heap(heap.begin(), heap.end(), std::greater<Candidate>());
+    for(mf_int j = 0; j < K; j++)
+    {
+        bool found = j < (mf_int)heap.size();
+        items[j] = found ? heap[j].second : -1;
+        scores[j] = found ? heap[j].first :
+                            std::numeric_limits<mf_float>::quiet_NaN();
+    }
+}
+
+void recommend_approx(mf_model const *model, ItemIndex const &index,
+                      mf_int const *users, mf_int nr_users,
+                      mf_int K, mf_int nr_probes,
+                      mf_problem const *exclude, mf_int nr_threads,
+                      mf_int *items, mf_float *scores)
+{
+    // Items to skip for each user, as sorted rows of a CSR matrix
+    std::vector<mf_long> ex_ptr(model->m+1, 0);
+    std::vector<mf_int> ex_items;
+    if(exclude != nullptr)
+    {
+        for(mf_long i = 0; i < exclude->nnz; i++)
+            if(exclude->R[i].u >= 0 && exclude->R[i].u < model->m)
+                ex_ptr[exclude->R[i].u+1]++;
+        for(mf_int u = 0; u < model->m; u++)
+            ex_ptr[u+1] += ex_ptr[u];
+
+        ex_items.resize(ex_ptr.back());
+        std::vector<mf_long> pos(ex_ptr.begin(), ex_ptr.end()-1);
+        for(mf_long i = 0; i < exclude->nnz; i++)
+            if(exclude->R[i].u >= 0 && exclude->R[i].u < model->m)
+                ex_items[pos[exclude->R[i].u]++] = exclude->R[i].v;
+
+#if defined USEOMP
+#pragma omp parallel for schedule(dynamic, 1024) num_threads(nr_threads)
+#endif
+        for(mf_int u = 0; u < model->m; u++)
+            std::sort(ex_items.begin()+ex_ptr[u], ex_items.begin()+ex_ptr[u+1]);
+    }
+
+#if defined USEOMP
+#pragma omp parallel for schedule(dynamic, 16) num_threads(nr_threads)
+#endif
+    for(mf_int i = 0; i < nr_users; i++)
+    {
+        mf_int u = users[i];
+        mf_int *items1 = items+(mf_long)i*K;
+        mf_float *scores1 = scores+(mf_long)i*K;
+        if(u < 0 || u >= model->m)
+        {
+            std::fill(items1, items1+K, -1);
+            std::fill(scores1, scores1+K, std::numeric_limits<mf_float>::quiet_NaN());
+            continue;
+        }
+
+        mf_int const *ex = ex_items.data();
+        index.search(model, model->P+(mf_long)u*model->k, K, nr_probes,
+                     ex+ex_ptr[u], ex+ex_ptr[u+1], items1, scores1);
+    }
+}
+
+
+} // namespace Reco
+
+typedef Rcpp::XPtr<Reco::ItemIndex> IndexPtr;
+
+RcppExport SEXP reco_build_index(SEXP handle, SEXP index_path_, SEXP nlist_,
+                                 SEXP nthread_)
+{
+BEGIN_RCPP
+
+    mf_model const *model = Reco::get_model(handle);
+    std::string index_path = Rcpp::as<std::string>(index_path_);
+
+    mf_int nr_lists = Rcpp::as<mf_int>(nlist_);
+    if(nr_lists < 0)
+        throw std::invalid_argument("number of lists should not be negative");
+
+    mf_int nr_threads = Rcpp::as<mf_int>(nthread_);
+    if(nr_threads <= 0)
+        throw std::invalid_argument("number of threads should be greater than zero");
+
+    Reco::ItemIndex *index = new Reco::ItemIndex;
+    IndexPtr ptr(index, true);
+    index->build(model, nr_lists, nr_threads);
+    index->save(index_path);
+
+    return ptr;
+
+END_RCPP
+}
+
+RcppExport SEXP reco_load_index(SEXP handle, SEXP index_path_)
+{
+BEGIN_RCPP
+
+    mf_model const *model = Reco::get_model(handle);
+    std::string index_path = Rcpp::as<std::string>(index_path_);
+
+    Reco::ItemIndex *index = new Reco::ItemIndex;
+    IndexPtr ptr(index, true);
+    index->load(index_path, model);
+
+    return ptr;
+
+END_RCPP
+}
+
+RcppExport SEXP reco_index_valid(SEXP index)
+{
+BEGIN_RCPP
+
+    return Rcpp::wrap(IndexPtr(index).get() != nullptr);
+
+END_RCPP
+}
@@ -0,0 +1,83 @@
+#ifndef RECO_INDEX_H
+#define RECO_INDEX_H
+
+#include <string>
+#include <vector>
+
+#include "mf.h"
+
+namespace Reco
+{
+
+// Layout of the index file. The header is followed by the centroids,
+// the list offsets and the item ids of the lists, in native byte order.
+// model_checksum is that of the item factors the index was built from.
+struct IndexHeader
+{
+    char magic[8];
+    mf::mf_int version;
+    mf::mf_int n;
+    mf::mf_int k;
+    mf::mf_int nr_lists;
+    mf::mf_float max_norm;
+    unsigned long long model_checksum;
+    char reserved[24];
+};
+
+const char kIndexMagic[8] = {'R', 'E', 'C', 'O', 'I', 'V', 'F', '\0'};
+const mf::mf_int kIndexVersion = 2;
+
+// Inverted file index for approximate maximum inner product search over
+// the item factors of a model.
+//
+// Each item vector q is mapped to the unit sphere as (q/M, sqrt(1-|q|^2/M^2)),
+// where M is the largest item norm, and a user vector p to (p/|p|, 0). The
+// Euclidean distance between the two then decreases as p.q increases, so
+// the items can be clustered by k-means and a query only needs to score
+// the items of the few lists whose centroids are closest to it. The index
+// stores item ids only; the item vectors are read from the model.
+class ItemIndex
+{
+public:
+    ItemIndex() : n(0), k(0), nr_lists(0), max_norm(0), model_checksum(0) {}
+
+    // Clusters the items of the model into nr_lists lists, or about
+    // sqrt(n) lists if nr_lists is zero
+    void build(mf::mf_model const *model, mf::mf_int nr_lists,
+               mf::mf_int nr_threads);
+
+    void save(const std::string &path) const;
+
+    // Loads an index built for the given model
+    void load(const std::string &path, mf::mf_model const *model);
+
+    // Finds the top K items of the user vector p among the items of the
+    // nr_probes lists closest to it. Items in the sorted range
+    // [ex_begin, ex_end) are skipped. Missing items are reported as -1
+    // with a NaN score.
+    void search(mf::mf_model const *model, mf::mf_float const *p,
+                mf::mf_int K, mf::mf_int nr_probes,
+                mf::mf_int const *ex_begin, mf::mf_int const *ex_end,
+                mf::mf_int *items, mf::mf_float *scores) const;
+
+    mf::mf_int n;
+    mf::mf_int k;
+    mf::mf_int nr_lists;
+    mf::mf_float max_norm;
+    unsigned long long model_checksum;
+    std::vector<mf::mf_float> centroids; // nr_lists x (k+1)
+    std::vector<mf::mf_long> offsets;    // nr_lists+1
+    std::vector<mf::mf_int> list_items;  // n
+};
+
+// Approximate counterpart of mf_recommend(), using the index
+void recommend_approx(mf::mf_model const *model, ItemIndex const &index,
+                      mf::mf_int const *users, mf::mf_int nr_users,
+                      mf::mf_int K, mf::mf_int nr_probes,
+                      mf::mf_problem const *exclude, mf::mf_int nr_threads,
+                      mf::mf_int *items, mf::mf_float *scores);
+
+
+} // namespace Reco
+
+#endif // RECO_INDEX_H
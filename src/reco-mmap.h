@@ -0,0 +1,182 @@
+#ifndef RECO_MMAP_H
+#define RECO_MMAP_H
+
+#include <cstddef>
+#include <cstdio>
+#include <string>
+
+#ifdef _WIN32
+  #ifndef WIN32_LEAN_AND_MEAN
+    #define WIN32_LEAN_AND_MEAN
+  #endif
+  #ifndef NOMINMAX
+    #define NOMINMAX
+  #endif
+  // R headers also define ERROR, which clashes with wingdi.h
+  #ifndef NOGDI
+    #define NOGDI
+  #endif
+  #include <windows.h>
+#else
+  #include <fcntl.h>
+  #include <sys/mman.h>
+  #include <sys/stat.h>
+  #include <unistd.h>
+#endif
+
+namespace Reco
+{
+
+// Maps a whole file into memory. The mapping is copy-on-write, so the
+// caller may modify the data in place (e.g. shuffling and scaling done
+// by fpsg()) without touching the file on disk.
+class MappedFile
+{
+public:
+    MappedFile() : addr(nullptr), len(0)
+#ifdef _WIN32
+        , mapping(NULL)
+#endif
+    {}
+
+    ~MappedFile() { close(); }
+
+    // Returns false if the file cannot be opened or mapped
+    bool open(const std::string &path)
+    {
+        close();
+#ifdef _WIN32
+        HANDLE file = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ,
+                                  NULL, OPEN_EXISTING,
+                                  FILE_ATTRIBUTE_NORMAL, NULL);
+        if(file == INVALID_HANDLE_VALUE)
+            return false;
+
+        LARGE_INTEGER size;
+        if(!GetFileSizeEx(file, &size))
+        {
+            CloseHandle(file);
+            return false;
+        }
+        len = (size_t)size.QuadPart;
+
+        // An empty file cannot be mapped, but is still a valid file
+        if(len == 0)
+        {
+            CloseHandle(file);
+            return true;
+        }
+
+        mapping = CreateFileMappingA(file, NULL, PAGE_WRITECOPY, 0, 0, NULL);
+        CloseHandle(file);
+        if(mapping == NULL)
+            return false;
+
+        addr = MapViewOfFile(mapping, FILE_MAP_COPY, 0, 0, 0);
+        if(addr == NULL)
+        {
+            CloseHandle(mapping);
+            mapping = NULL;
+            return false;
+        }
+#else
+        int fd = ::open(path.c_str(), O_RDONLY);
+        if(fd < 0)
+            return false;
+
+        struct stat st;
+        if(fstat(fd, &st) != 0)
+        {
+            ::close(fd);
+            return false;
+        }
+        len = (size_t)st.st_size;
+
+        if(len == 0)
+        {
+            ::close(fd);
+            return true;
+        }
+
+        void *ptr = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+        ::close(fd);
+        if(ptr == MAP_FAILED)
+        {
+            len = 0;
+            return false;
+        }
+        addr = ptr;
+#endif
+        return true;
+    }
+
+    void close()
+    {
+        if(addr != nullptr)
+        {
+#ifdef _WIN32
+            UnmapViewOfFile(addr);
+            CloseHandle(mapping);
+            mapping = NULL;
+#else
+            munmap(addr, len);
+#endif
+        }
+        addr = nullptr;
+        len = 0;
+    }
+
+    // Hints that the mapping will be read from front to back
+    void advise_sequential() const
+    {
+#if !defined(_WIN32) && defined(MADV_SEQUENTIAL)
+        if(addr != nullptr)
+            madvise(addr, len, MADV_SEQUENTIAL);
+#endif
+    }
+
+    // Starts reading in the pages of [begin, end) in the background
+    void prefetch(const void *begin, const void *end) const
+    {
+#if !defined(_WIN32) && defined(MADV_WILLNEED)
+        if(addr == nullptr || begin >= end)
+            return;
+
+        const size_t page = (size_t)sysconf(_SC_PAGESIZE);
+        const size_t first = ((const char *)begin - (const char *)addr)/page*page;
+        const size_t last = (const char *)end - (const char *)addr;
+        madvise((char *)addr + first, last - first, MADV_WILLNEED);
+#endif
+    }
+
+    char *data() const { return (char *)addr; }
+    size_t size() const { return len; }
+
+private:
+    MappedFile(const MappedFile &);
+    MappedFile &operator=(const MappedFile &);
+
+    void *addr;
+    size_t len;
+#ifdef _WIN32
+    HANDLE mapping;
+#endif
+};
+
+// Moves the file at from over the file at to in one step, so that readers
+// of to see either the old file or the new one, and mappings of the old
+// file keep their data. Returns false if the file cannot be moved.
+inline bool replace_file(const std::string &from, const std::string &to)
+{
+#ifdef _WIN32
+    return MoveFileExA(from.c_str(), to.c_str(),
+                       MOVEFILE_REPLACE_EXISTING) != 0;
+#else
+    return std::rename(from.c_str(), to.c_str()) == 0;
+#endif
+}
+
+
+} // namespace Reco
+
+#endif // RECO_MMAP_H
@@ -0,0 +1,76 @@
+#ifndef RECO_MODEL_H
+#define RECO_MODEL_H
+
+#include <Rcpp.h>
+
+#include "mf.h"
+
+namespace Reco
+{
+
+inline void finalize_model(mf::mf_model *model)
+{
+    mf::mf_destroy_model(&model);
+}
+
+// A model loaded once and kept alive on the R side as an external
+// pointer, so that repeated calls do not load the model file again
+typedef Rcpp::XPtr<mf::mf_model, Rcpp::PreserveStorage, finalize_model> ModelPtr;
+
+// The tag of model handles, checked before the pointer is cast
+inline SEXP model_tag()
+{
+    return Rf_install("reco_model");
+}
+
+inline ModelPtr make_model_ptr(mf::mf_model *model)
+{
+    return ModelPtr(model, true, model_tag());
+}
+
+// The model behind a handle returned by reco_load_model. The pointer is
+// null if the handle did not survive a save and reload of the R session.
+inline mf::mf_model *get_model(SEXP handle)
+{
+    if(TYPEOF(handle) != EXTPTRSXP || R_ExternalPtrTag(handle) != model_tag())
+        throw std::invalid_argument("handle is not that of a model");
+
+    mf::mf_model *model = ModelPtr(handle).get();
+    if(model == nullptr)
+        throw std::invalid_argument("model handle is no longer valid");
+    return model;
+}
+
+inline void finalize_qmodel(mf::mf_qmodel *model)
+{
+    mf::mf_destroy_qmodel(&model);
+}
+
+// The int8 model built by reco_quantize or loaded by reco_load_qmodel
+typedef Rcpp::XPtr<mf::mf_qmodel, Rcpp::PreserveStorage, finalize_qmodel> QModelPtr;
+
+inline SEXP qmodel_tag()
+{
+    return Rf_install("reco_qmodel");
+}
+
+inline QModelPtr make_qmodel_ptr(mf::mf_qmodel *model)
+{
+    return QModelPtr(model, true, qmodel_tag());
+}
+
+inline mf::mf_qmodel *get_qmodel(SEXP handle)
+{
+    if(TYPEOF(handle) != EXTPTRSXP || R_ExternalPtrTag(handle) != qmodel_tag())
+        throw std::invalid_argument("handle is not that of an int8 model");
+
+    mf::mf_qmodel *model = QModelPtr(handle).get();
+    if(model == nullptr)
+        throw std::invalid_argument("int8 model handle is no longer valid");
+    return model;
+}
+
+
+} // namespace Reco
+
+#endif // RECO_MODEL_H
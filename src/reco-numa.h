@@ -0,0 +1,131 @@
+#ifndef RECO_NUMA_H
+#define RECO_NUMA_H
+
+#include <algorithm>
+#include <cstdio>
+#include <fstream>
+#include <string>
+#include <vector>
+
+#ifdef __linux__
+  #include <sched.h>
+#endif
+
+namespace Reco
+{
+
+// The CPUs that the process may run on, grouped by NUMA node. The nodes
+// are read from sysfs on Linux, where threads can be pinned to them.
+// Elsewhere there is a single node and pinning does nothing.
+class Topology
+{
+public:
+    Topology()
+    {
+#ifdef __linux__
+        CPU_ZERO(&allowed);
+        if(sched_getaffinity(0, sizeof(allowed), &allowed) != 0)
+            return;
+
+        std::vector<int> online = read_list("/sys/devices/system/node/online");
+        for(int node : online)
+        {
+            char path[64];
+            std::snprintf(path, sizeof(path),
+                          "/sys/devices/system/node/node%d/cpulist", node);
+            std::vector<int> cpus;
+            for(int cpu : read_list(path))
+                if(cpu < CPU_SETSIZE && CPU_ISSET(cpu, &allowed))
+                    cpus.push_back(cpu);
+            if(!cpus.empty())
+                nodes.push_back(cpus);
+        }
+
+        // Without sysfs all the allowed CPUs are taken as one node
+        if(nodes.empty())
+        {
+            std::vector<int> cpus;
+            for(int cpu = 0; cpu < CPU_SETSIZE; cpu++)
+                if(CPU_ISSET(cpu, &allowed))
+                    cpus.push_back(cpu);
+            if(!cpus.empty())
+                nodes.push_back(cpus);
+        }
+#endif
+    }
+
+    int nr_nodes() const { return std::max((int)nodes.size(), 1); }
+
+    // Pins the calling thread to CPU i of the node, counting modulo the
+    // number of its CPUs, or to any CPU of the node if i is negative.
+    // Returns false if the thread cannot be pinned.
+    bool pin(int node, int i) const
+    {
+#ifdef __linux__
+        if(node < 0 || node >= (int)nodes.size())
+            return false;
+
+        std::vector<int> const &cpus = nodes[node];
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        if(i >= 0)
+            CPU_SET(cpus[i%cpus.size()], &set);
+        else
+            for(int cpu : cpus)
+                CPU_SET(cpu, &set);
+        return sched_setaffinity(0, sizeof(set), &set) == 0;
+#else
+        (void)node;
+        (void)i;
+        return false;
+#endif
+    }
+
+    // Lets the calling thread run on all the CPUs of the process again
+    void unpin() const
+    {
+#ifdef __linux__
+        if(!nodes.empty())
+            sched_setaffinity(0, sizeof(allowed), &allowed);
+#endif
+    }
+
+private:
+    // Reads a sysfs list such as "0-3,8,10-11". Returns an empty list if
+    // the file cannot be read.
+    static std::vector<int> read_list(char const *path)
+    {
+        std::vector<int> list;
+        std::ifstream file(path);
+        std::string text;
+        if(!std::getline(file, text))
+            return list;
+
+        size_t pos = 0;
+        while(pos < text.size())
+        {
+            size_t end = text.find(',', pos);
+            if(end == std::string::npos)
+                end = text.size();
+            int first, last;
+            std::string range = text.substr(pos, end-pos);
+            int nr_read = std::sscanf(range.c_str(), "%d-%d", &first, &last);
+            if(nr_read == 1)
+                last = first;
+            if(nr_read >= 1)
+                for(int x = first; x <= last; x++)
+                    list.push_back(x);
+            pos = end+1;
+        }
+        return list;
+    }
+
+    std::vector<std::vector<int>> nodes;
+#ifdef __linux__
+    cpu_set_t allowed;
+#endif
+};
+
+} // namespace Reco
+
+#endif // RECO_NUMA_H
@@ -3,17 +3,28 @@
 #include <fstream>
 #include <string>
 #include <algorithm>
+#include <stdexcept>
 #include "mf.h"
 
 using namespace mf;
 
-RcppExport SEXP reco_output_memory(SEXP model)
+// Number of threads passed from R, which should be positive
+mf_int get_nr_threads(SEXP nthread_)
+{
+    mf_int nr_threads = Rcpp::as<mf_int>(nthread_);
+    if(nr_threads <= 0)
+        throw std::invalid_argument("number of threads should be greater than zero");
+    return nr_threads;
+}
+
+RcppExport SEXP reco_output_memory(SEXP model, SEXP nthread_)
 {
 BEGIN_RCPP
 
     std::string model_path = Rcpp::as<std::string>(model);
+    mf_int nr_threads = get_nr_threads(nthread_);
 
-    mf_model *model = mf_load_model(model_path.c_str());
+    mf_model *model = mf_load_model(model_path.c_str(), nr_threads);
     if(model == nullptr)
         Rcpp::stop("cannot load model from " + model_path);
 
@@ -34,69 +45,69 @@ BEGIN_RCPP
 END_RCPP
 }
 
-RcppExport SEXP reco_output(SEXP model, SEXP P, SEXP Q)
+// Writes one row of the factor matrix per line, values separated by spaces
+void write_factors(mf_float const *ptr, mf_int size, mf_int k,
+                   std::string const &path)
+{
+    std::ofstream f(path);
+    if(!f.is_open())
+        Rcpp::stop("cannot write " + path);
+
+    for(mf_int i = 0; i < size; i++)
+    {
+        mf_float const *ptr1 = ptr + (mf_long)i*k;
+        for(mf_int d = 0; d < k; d++)
+        {
+            if(d > 0)
+                f << ' ';
+            f << ptr1[d];
+        }
+        f << '\n';
+    }
+
+    if(!f)
+        Rcpp::stop("cannot write " + path);
+}
+
+RcppExport SEXP reco_output(SEXP model, SEXP P, SEXP Q, SEXP text_model,
+                            SEXP nthread_)
 {
 BEGIN_RCPP
 
     std::string model_path = Rcpp::as<std::string>(model);
     std::string P_path = Rcpp::as<std::string>(P);
     std::string Q_path = Rcpp::as<std::string>(Q);
+    std::string text_model_path = Rcpp::as<std::string>(text_model);
+    mf_int nr_threads = get_nr_threads(nthread_);
 
-    std::ifstream f(model_path);
-    if(!f.is_open())
-        Rcpp::stop("cannot open " + model_path);
-
-    // Get dimensions
-    std::string line;
-    // mf_int m, n, k;
-    mf_int m, n;
-    std::getline(f, line);
-    m = atoi(line.substr(line.find(' ') + 1).c_str());
-    std::getline(f, line);
-    n = atoi(line.substr(line.find(' ') + 1).c_str());
-    std::getline(f, line);
-    // k = atoi(line.substr(line.find(' ') + 1).c_str());
-
-    // Writing P matrix
-    if(!P_path.empty())
-    {
-        std::ofstream fp(P_path);
-        if(!fp.is_open())
-            Rcpp::stop("cannot write " + P_path);
-
-        for(mf_int i = 0; i < m; i++)
-        {
-            std::getline(f, line);
-            std::size_t pos = line.find(' ');
-            // Remove the beginning pos+1 characters, and the space at the tail
-            fp << line.substr(pos + 1, line.length() - pos - 2) << std::endl;
-        }
+    mf_model *model = mf_load_model(model_path.c_str(), nr_threads);
+    if(model == nullptr)
+        Rcpp::stop("cannot load model from " + model_path);
 
-        fp.close();
-    } else {
-        // Skip m lines
-        for(mf_int i = 0; i < m; i++)
-            f.ignore(std::numeric_limits<std::streamsize>::max(), '\n');
+    try
+    {
+        // Writing P matrix
+        if(!P_path.empty())
+            write_factors(model->P, model->m, model->k, P_path);
+
+        // Writing Q matrix
+        if(!Q_path.empty())
+            write_factors(model->Q, model->n, model->k, Q_path);
+
+        // Exporting the whole model in the LIBMF text format
+        if(!text_model_path.empty() &&
+           mf_save_model_text(model, text_model_path.c_str(),
+                              nr_threads) != 0)
+            Rcpp::stop("cannot write " + text_model_path);
     }
-
-    // Writing Q matrix
-    if(!Q_path.empty())
+    catch(...)
     {
-        std::ofstream fq(Q_path);
-        if(!fq.is_open())
-            Rcpp::stop("cannot write " + Q_path);
-
-        for(mf_int i = 0; i < n; i++)
-        {
-            std::getline(f, line);
-            std::size_t pos = line.find(' ');
-            // Remove the beginning pos+1 characters, and the space at the tail
-            fq << line.substr(pos + 1, line.length() - pos - 2) << std::endl;
-        }
-
-        fq.close();
+        mf_destroy_model(&model);
+        throw;
     }
 
+    mf_destroy_model(&model);
+
     return R_NilValue;
 
 END_RCPP
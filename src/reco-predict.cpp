@@ -1,81 +1,429 @@
+#include <cstdio>
 #include <cstring>
 #include <fstream>
 #include <iostream>
 #include <string>
-#include <iomanip>
 #include <memory>
-#include <cmath>
+#include <algorithm>
 #include <stdexcept>
 #include <vector>
 
 #include <Rcpp.h>
 
 #include "mf.h"
+#include "reco-data.h"
+#include "reco-model.h"
+#include "reco-text.h"
+
+// _OPENMP will be defined if OpenMP is enabled,
+// so we can detect this automatically
+#ifdef _OPENMP
+  #ifndef USEOMP
+    #define USEOMP
+  #endif
+#endif
+
+#if defined USEOMP
+#include <omp.h>
+#endif
 
 using namespace mf;
 
-RcppExport SEXP reco_predict_memory(SEXP test, SEXP model)
+namespace
 {
-BEGIN_RCPP
 
-    std::string test_path = Rcpp::as<std::string>(test);
-    std::string model_path = Rcpp::as<std::string>(model);
+struct PredictOption
+{
+    PredictOption() : nr_threads(1), by_user(false), int8(false) {}
+    mf_int nr_threads;
+    bool by_user;
+    bool int8;
+};
 
-    std::ifstream f_te(test_path);
-    if(!f_te.is_open())
-        Rcpp::stop("cannot open " + test_path);
+PredictOption parse_predict_option(SEXP opts_)
+{
+    Rcpp::List opts(opts_);
 
-    mf_model *model = mf_load_model(model_path.c_str());
-    if(model == nullptr)
-        Rcpp::stop("cannot load model from " + model_path);
+    PredictOption option;
 
-    std::vector<double> res;
-    res.reserve(1000);
+    // Number of threads
+    option.nr_threads = Rcpp::as<mf_int>(opts["nthread"]);
+    if(option.nr_threads <= 0)
+        throw std::invalid_argument("number of threads should be greater than zero");
+
+    // Whether to visit the pairs grouped by user
+    option.by_user = Rcpp::as<bool>(opts["by_user"]);
+
+    // Whether to score with the int8 model
+    option.int8 = Rcpp::as<bool>(opts["int8"]);
+
+    return option;
+}
+
+// Amount of test data handled by each thread at a time, in bytes of text
+// and in pairs of binary data
+const std::size_t kWindowBytes = 1 << 24;
+const mf_long kWindowNodes = 1 << 20;
+
+// A range of pairs to be predicted by one thread
+struct Span
+{
+    mf_node *R;
+    mf_long size;
+};
+
+// Parses the lines in [begin, end) as "row col" pairs, ignoring anything
+// after them. Lines that do not start with such a pair are skipped.
+void parse_pairs(const char *begin, const char *end,
+                 std::vector<mf_node> &nodes)
+{
+    nodes.clear();
 
     mf_node N;
-    while(f_te >> N.u >> N.v)
+    N.r = 0;
+    for(const char *p = begin; p != end;)
+    {
+        const char *eol = Reco::next_line(p, end);
+
+        const char *s = p;
+        if(Reco::parse_int(s, eol, N.u) && Reco::parse_int(s, eol, N.v))
+            nodes.push_back(N);
+
+        p = eol;
+    }
+}
+
+// Formats the predictions as operator<< does, one per line
+void format_predictions(Span const &span, std::string &buffer)
+{
+    char value[32];
+
+    buffer.clear();
+    for(mf_long i = 0; i < span.size; i++)
+        buffer.append(value, snprintf(value, sizeof(value), "%g\n",
+                                      span.R[i].r));
+}
+
+// Scoring with either kind of model
+inline mf_float predict_pair(mf_model const *model, mf_int u, mf_int v)
+{
+    return mf_predict(model, u, v);
+}
+
+inline mf_float predict_pair(mf_qmodel const *model, mf_int u, mf_int v)
+{
+    return mf_qpredict(model, u, v);
+}
+
+inline void predict_nodes(mf_model const *model, mf_node *R, mf_long size,
+                          bool by_user, mf_int nr_threads)
+{
+    mf_predict_nodes(model, R, size, by_user, nr_threads);
+}
+
+inline void predict_nodes(mf_qmodel const *model, mf_node *R, mf_long size,
+                          bool by_user, mf_int nr_threads)
+{
+    mf_qpredict_nodes(model, R, size, by_user, nr_threads);
+}
+
+// Scores the test data a window at a time. Within a window every thread
+// predicts its own span of pairs and, when writing to a file, formats
+// them into its own buffer; the results are then passed on in order,
+// either written to out or appended to res. With by_user, the pairs of
+// the whole window are grouped by user and predicted by all the threads
+// together instead.
+template<typename Model>
+class Predictor
+{
+public:
+    Predictor(Model const *model, PredictOption const &option,
+              std::ofstream *out, std::vector<double> *res) :
+        model(model), option(option), out(out), res(res),
+        spans(option.nr_threads), buffers(option.nr_threads) {}
+
+    void run(const std::string &test_path)
+    {
+        if(Reco::is_binary_file(test_path))
+            run_binary(test_path);
+        else
+            run_text(test_path);
+    }
+
+private:
+    void run_text(const std::string &test_path)
+    {
+        Reco::MappedFile file;
+        if(!file.open(test_path))
+            throw std::runtime_error("cannot open " + test_path);
+        file.advise_sequential();
+
+        const mf_int nr_threads = option.nr_threads;
+        const std::size_t window = nr_threads*kWindowBytes;
+        std::vector<std::vector<mf_node>> chunks(nr_threads);
+
+        const char *end = file.data() + file.size();
+        for(const char *begin = file.data(); begin != end;)
+        {
+            const char *last = (std::size_t)(end - begin) <= window ?
+                               end : Reco::next_line(begin + window - 1, end);
+            std::vector<const char *> bounds =
+                Reco::split_lines(begin, last, nr_threads);
+
+#if defined USEOMP
+#pragma omp parallel for schedule(static, 1) num_threads(nr_threads)
+#endif
+            for(mf_int i = 0; i < nr_threads; i++)
+            {
+                parse_pairs(bounds[i], bounds[i+1], chunks[i]);
+                spans[i].R = chunks[i].data();
+                spans[i].size = chunks[i].size();
+                if(!option.by_user)
+                    predict(i);
+            }
+
+            if(option.by_user)
+            {
+                // The spans are moved next to each other, to be grouped
+                nodes.clear();
+                for(mf_int i = 0; i < nr_threads; i++)
+                    nodes.insert(nodes.end(), chunks[i].begin(),
+                                 chunks[i].end());
+                mf_long offset = 0;
+                for(mf_int i = 0; i < nr_threads; i++)
+                {
+                    spans[i].R = nodes.data() + offset;
+                    offset += spans[i].size;
+                }
+                predict_window(nodes.data(), nodes.size());
+            }
+
+            flush();
+            begin = last;
+        }
+    }
+
+    void run_binary(const std::string &test_path)
+    {
+        Reco::ProblemData te;
+        Reco::read_problem(test_path, option.nr_threads, te);
+
+        const mf_int nr_threads = option.nr_threads;
+        const mf_long window = nr_threads*kWindowNodes;
+
+        for(mf_long begin = 0; begin < te.prob.nnz; begin += window)
+        {
+            mf_long size = std::min(window, te.prob.nnz - begin);
+
+#if defined USEOMP
+#pragma omp parallel for schedule(static, 1) num_threads(nr_threads)
+#endif
+            for(mf_int i = 0; i < nr_threads; i++)
+            {
+                mf_long first = begin + size*i/nr_threads;
+                mf_long last = begin + size*(i+1)/nr_threads;
+                spans[i].R = te.prob.R + first;
+                spans[i].size = last - first;
+                if(!option.by_user)
+                    predict(i);
+            }
+
+            if(option.by_user)
+                predict_window(te.prob.R + begin, size);
+
+            flush();
+        }
+    }
+
+    void predict(mf_int i)
+    {
+        predict_nodes(model, spans[i].R, spans[i].size, false, 1);
+        if(out != nullptr)
+            format_predictions(spans[i], buffers[i]);
+    }
+
+    // Predicts the size pairs at R, which the spans cover, grouped by user
+    void predict_window(mf_node *R, mf_long size)
+    {
+        const mf_int nr_threads = option.nr_threads;
+        predict_nodes(model, R, size, true, nr_threads);
+        if(out == nullptr)
+            return;
+
+#if defined USEOMP
+#pragma omp parallel for schedule(static, 1) num_threads(nr_threads)
+#endif
+        for(mf_int i = 0; i < nr_threads; i++)
+            format_predictions(spans[i], buffers[i]);
+    }
+
+    void flush()
     {
-        f_te.ignore(std::numeric_limits<std::streamsize>::max(), '\n');
-        mf_float r = mf_predict(model, N.u, N.v);
-        res.push_back(r);
+        for(mf_int i = 0; i < option.nr_threads; i++)
+        {
+            if(out != nullptr)
+            {
+                out->write(buffers[i].data(), buffers[i].size());
+                continue;
+            }
+            for(mf_long j = 0; j < spans[i].size; j++)
+                res->push_back(spans[i].R[j].r);
+        }
     }
 
-    mf_destroy_model(&model);
+    Model const *model;
+    PredictOption option;
+    std::ofstream *out;
+    std::vector<double> *res;
+    std::vector<Span> spans;
+    std::vector<std::string> buffers;
+    std::vector<mf_node> nodes;
+};
+
+// Batches smaller than this are scored by the calling thread alone, as
+// starting the threads would cost more than the scoring itself
+const mf_long kMinParallelPairs = 1 << 14;
+
+// Scores the pairs of user and item indices into res. Missing indices
+// give missing predictions.
+template<typename Model>
+void predict_vectors(Model const *model, int const *user, int const *item,
+                     mf_long size, mf_int nr_threads, double *res)
+{
+#if defined USEOMP
+#pragma omp parallel for schedule(static) num_threads(nr_threads) if(size >= kMinParallelPairs)
+#endif
+    for(mf_long i = 0; i < size; i++)
+    {
+        if(user[i] == NA_INTEGER || item[i] == NA_INTEGER)
+            res[i] = NA_REAL;
+        else
+            res[i] = predict_pair(model, user[i], item[i]);
+    }
+}
+
+// Loads the model at model_path, or the int8 model if asked to, and
+// scores the test data with it
+void predict_file(const std::string &test_path, const std::string &model_path,
+                  PredictOption const &option, std::ofstream *out,
+                  std::vector<double> *res)
+{
+    if(option.int8)
+    {
+        std::shared_ptr<mf_qmodel> model_ptr(mf_load_qmodel(model_path.c_str()),
+            [] (mf_qmodel *ptr) { mf_destroy_qmodel(&ptr); });
+        if(model_ptr == nullptr)
+            Rcpp::stop("cannot load int8 model from " + model_path);
+
+        Predictor<mf_qmodel>(model_ptr.get(), option, out, res).run(test_path);
+        return;
+    }
+
+    std::shared_ptr<mf_model> model_ptr(mf_load_model(model_path.c_str(),
+                                                      option.nr_threads),
+        [] (mf_model *ptr) { mf_destroy_model(&ptr); });
+    if(model_ptr == nullptr)
+        Rcpp::stop("cannot load model from " + model_path);
+
+    Predictor<mf_model>(model_ptr.get(), option, out, res).run(test_path);
+}
+
+} // namespace
+
+RcppExport SEXP reco_load_model(SEXP model)
+{
+BEGIN_RCPP
+
+    std::string model_path = Rcpp::as<std::string>(model);
+
+    // $train() writes binary models, which are mapped rather than parsed
+    mf_model *ptr = mf_load_model(model_path.c_str(), 1);
+    if(ptr == nullptr)
+        Rcpp::stop("cannot load model from " + model_path);
+
+    return Reco::make_model_ptr(ptr);
+
+END_RCPP
+}
+
+RcppExport SEXP reco_model_valid(SEXP handle)
+{
+BEGIN_RCPP
+
+    return Rcpp::wrap(Reco::ModelPtr(handle).get() != nullptr);
+
+END_RCPP
+}
+
+// Unloads the model before its file is written again
+RcppExport SEXP reco_release_model(SEXP handle)
+{
+BEGIN_RCPP
+
+    Reco::ModelPtr(handle).release();
+    return R_NilValue;
+
+END_RCPP
+}
+
+RcppExport SEXP reco_predict_vectors(SEXP handle, SEXP user_, SEXP item_, SEXP opts_)
+{
+BEGIN_RCPP
+
+    Rcpp::IntegerVector user(user_);
+    Rcpp::IntegerVector item(item_);
+    PredictOption option = parse_predict_option(opts_);
+
+    if(user.length() != item.length())
+        throw std::invalid_argument("user and item vectors should have the same length");
+
+    // The handle is that of the int8 model when scoring with it
+    Rcpp::NumericVector res(user.length());
+    if(option.int8)
+        predict_vectors(Reco::get_qmodel(handle), user.begin(), item.begin(),
+                        user.length(), option.nr_threads, res.begin());
+    else
+        predict_vectors(Reco::get_model(handle), user.begin(), item.begin(),
+                        user.length(), option.nr_threads, res.begin());
+
+    return res;
+
+END_RCPP
+}
+
+RcppExport SEXP reco_predict_memory(SEXP test, SEXP model, SEXP opts_)
+{
+BEGIN_RCPP
+
+    std::string test_path = Rcpp::as<std::string>(test);
+    std::string model_path = Rcpp::as<std::string>(model);
+    PredictOption option = parse_predict_option(opts_);
+
+    std::vector<double> res;
+    predict_file(test_path, model_path, option, nullptr, &res);
 
     return Rcpp::wrap(res);
 
 END_RCPP
 }
 
-RcppExport SEXP reco_predict(SEXP test, SEXP model, SEXP output)
+RcppExport SEXP reco_predict(SEXP test, SEXP model, SEXP output, SEXP opts_)
 {
 BEGIN_RCPP
 
     std::string test_path = Rcpp::as<std::string>(test);
     std::string model_path = Rcpp::as<std::string>(model);
     std::string output_path = Rcpp::as<std::string>(output);
-
-    std::ifstream f_te(test_path);
-    if(!f_te.is_open())
-        Rcpp::stop("cannot open " + test_path);
+    PredictOption option = parse_predict_option(opts_);
 
     std::ofstream f_out(output_path);
     if(!f_out.is_open())
         Rcpp::stop("cannot open " + output_path);
 
-    mf_model *model = mf_load_model(model_path.c_str());
-    if(model == nullptr)
-        Rcpp::stop("cannot load model from " + model_path);
-
-    mf_node N;
-    while(f_te >> N.u >> N.v)
-    {
-        f_te.ignore(std::numeric_limits<std::streamsize>::max(), '\n');
-        mf_float r = mf_predict(model, N.u, N.v);
-        f_out << r << std::endl;
-    }
+    predict_file(test_path, model_path, option, &f_out, nullptr);
 
-    mf_destroy_model(&model);
+    if(!f_out)
+        Rcpp::stop("cannot write to " + output_path);
 
     return R_NilValue;
 
@@ -0,0 +1,110 @@
+#include <string>
+#include <cmath>
+#include <stdexcept>
+#include <algorithm>
+
+#include <Rcpp.h>
+
+#include "mf.h"
+#include "reco-data.h"
+#include "reco-model.h"
+
+using namespace mf;
+
+namespace
+{
+
+// RMSE of the model on the rated pairs of te
+template<typename Model>
+double calc_rmse(Model const *model, mf_problem const &te,
+                 mf_float (*predict)(Model const *, mf_int, mf_int))
+{
+    double loss = 0;
+    for(mf_long i = 0; i < te.nnz; i++)
+    {
+        mf_node const &N = te.R[i];
+        double e = N.r - predict(model, N.u, N.v);
+        loss += e*e;
+    }
+    return te.nnz > 0 ? std::sqrt(loss/te.nnz) : NA_REAL;
+}
+
+} // namespace
+
+RcppExport SEXP reco_quantize(SEXP handle, SEXP quant_path_, SEXP test_,
+                              SEXP nthread_)
+{
+BEGIN_RCPP
+
+    mf_model const *model = Reco::get_model(handle);
+    std::string quant_path = Rcpp::as<std::string>(quant_path_);
+
+    mf_int nr_threads = Rcpp::as<mf_int>(nthread_);
+    if(nr_threads <= 0)
+        throw std::invalid_argument("number of threads should be greater than zero");
+
+    Reco::QModelPtr ptr = Reco::make_qmodel_ptr(mf_quantize_model(model, nr_threads));
+    if(mf_save_qmodel(ptr.get(), quant_path.c_str()) != 0)
+        Rcpp::stop("cannot save int8 model to " + quant_path);
+
+    // The accuracy lost by quantization, if testing data are given
+    double rmse = NA_REAL, rmse_int8 = NA_REAL;
+    if(!Rf_isNull(test_))
+    {
+        Reco::ProblemData te;
+        Reco::read_problem(test_, nr_threads, te);
+        rmse = calc_rmse(model, te.prob, mf_predict);
+        rmse_int8 = calc_rmse(ptr.get(), te.prob, mf_qpredict);
+    }
+
+    // Rows that were not finite, which quantization marks with NaN scales
+    mf_qmodel const *qmodel = ptr.get();
+    int nr_nonfinite = (int)(
+        std::count_if(qmodel->P_scale, qmodel->P_scale+qmodel->m,
+                      [] (mf_float s) { return std::isnan(s); }) +
+        std::count_if(qmodel->Q_scale, qmodel->Q_scale+qmodel->n,
+                      [] (mf_float s) { return std::isnan(s); }));
+
+    return Rcpp::List::create(
+        Rcpp::Named("handle") = ptr,
+        Rcpp::Named("rmse") = rmse,
+        Rcpp::Named("rmse_int8") = rmse_int8,
+        Rcpp::Named("nonfinite") = nr_nonfinite
+    );
+
+END_RCPP
+}
+
+RcppExport SEXP reco_load_qmodel(SEXP quant_path_)
+{
+BEGIN_RCPP
+
+    std::string quant_path = Rcpp::as<std::string>(quant_path_);
+
+    mf_qmodel *ptr = mf_load_qmodel(quant_path.c_str());
+    if(ptr == nullptr)
+        Rcpp::stop("cannot load int8 model from " + quant_path);
+
+    return Reco::make_qmodel_ptr(ptr);
+
+END_RCPP
+}
+
+RcppExport SEXP reco_qmodel_valid(SEXP handle)
+{
+BEGIN_RCPP
+
+    return Rcpp::wrap(Reco::QModelPtr(handle).get() != nullptr);
+
+END_RCPP
+}
+
+RcppExport SEXP reco_release_qmodel(SEXP handle)
+{
+BEGIN_RCPP
+
+    Reco::QModelPtr(handle).release();
+    return R_NilValue;
+
+END_RCPP
+}
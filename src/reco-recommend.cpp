@@ -0,0 +1,88 @@
+#include <string>
+#include <cmath>
+#include <stdexcept>
+#include <vector>
+
+#include <Rcpp.h>
+
+#include "mf.h"
+#include "reco-data.h"
+#include "reco-index.h"
+#include "reco-model.h"
+
+using namespace mf;
+
+RcppExport SEXP reco_recommend(SEXP handle, SEXP users_, SEXP nrec_,
+                               SEXP exclude_, SEXP opts_, SEXP index_)
+{
+BEGIN_RCPP
+
+    Rcpp::IntegerVector users(users_);
+    Rcpp::List opts(opts_);
+
+    mf_int K = Rcpp::as<mf_int>(nrec_);
+    if(K <= 0)
+        throw std::invalid_argument("number of recommended items should be greater than zero");
+
+    mf_int nr_threads = Rcpp::as<mf_int>(opts["nthread"]);
+    if(nr_threads <= 0)
+        throw std::invalid_argument("number of threads should be greater than zero");
+
+    // Number of index lists to search, or zero to score all items
+    mf_int nr_probes = Rcpp::as<mf_int>(opts["nprobe"]);
+    if(nr_probes < 0)
+        throw std::invalid_argument("number of probed lists should not be negative");
+
+    // Whether to score with the int8 model, whose handle is passed instead
+    bool int8 = Rcpp::as<bool>(opts["int8"]);
+    if(int8 && nr_probes > 0)
+        throw std::invalid_argument("approximate search is not available for the int8 model");
+
+    Reco::ItemIndex const *index = nullptr;
+    if(nr_probes > 0)
+    {
+        if(Rf_isNull(index_) ||
+           (index = Rcpp::XPtr<Reco::ItemIndex>(index_).get()) == nullptr)
+            throw std::invalid_argument("no index built for the model");
+    }
+
+    // Items rated in the training data, if they are to be left out
+    Reco::ProblemData exclude;
+    if(!Rf_isNull(exclude_))
+        Reco::read_problem(exclude_, nr_threads, exclude);
+
+    mf_int nr_users = users.length();
+    std::vector<mf_int> items((mf_long)nr_users*K);
+    std::vector<mf_float> scores((mf_long)nr_users*K);
+    mf_problem const *ex = Rf_isNull(exclude_) ? nullptr : &exclude.prob;
+    if(int8)
+        mf_qrecommend(Reco::get_qmodel(handle), users.begin(), nr_users, K, ex,
+                      nr_threads, items.data(), scores.data());
+    else if(index != nullptr)
+        Reco::recommend_approx(Reco::get_model(handle), *index, users.begin(),
+                               nr_users, K, nr_probes, ex, nr_threads,
+                               items.data(), scores.data());
+    else
+        mf_recommend(Reco::get_model(handle), users.begin(), nr_users, K, ex,
+                     nr_threads, items.data(), scores.data());
+
+    // One row per user, with the best item in the first column
+    Rcpp::IntegerMatrix item(nr_users, K);
+    Rcpp::NumericMatrix score(nr_users, K);
+    for(mf_int i = 0; i < nr_users; i++)
+    {
+        for(mf_int j = 0; j < K; j++)
+        {
+            mf_long pos = (mf_long)i*K+j;
+            item(i, j) = items[pos] < 0 ? NA_INTEGER : items[pos];
+            score(i, j) = std::isnan(scores[pos]) ? NA_REAL : scores[pos];
+        }
+    }
+
+    return Rcpp::List::create(
+        Rcpp::Named("item") = item,
+        Rcpp::Named("score") = score
+    );
+
+END_RCPP
+}
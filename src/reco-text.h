@@ -0,0 +1,186 @@
+#ifndef RECO_TEXT_H
+#define RECO_TEXT_H
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <limits>
+#include <vector>
+
+#include "mf.h"
+
+namespace Reco
+{
+
+// Locale-independent number parsing on raw character ranges. These follow
+// the rules of operator>> closely enough for data and model files: leading
+// blanks are skipped, and a field fails if it does not start with a number.
+// Parsing stops at the end of the number; the pointer is advanced past it.
+
+inline bool is_blank(char c)
+{
+    return c == ' ' || c == '\t' || c == '\r' || c == '\v' || c == '\f';
+}
+
+inline bool is_digit(char c)
+{
+    return (unsigned char)(c - '0') < 10;
+}
+
+// Skips blanks, but never past the end of the line
+inline const char *skip_blank(const char *p, const char *end)
+{
+    while(p != end && is_blank(*p))
+        p++;
+    return p;
+}
+
+// Position right after the next newline, or end
+inline const char *next_line(const char *p, const char *end)
+{
+    const char *eol = (const char *)std::memchr(p, '\n', end - p);
+    return eol == nullptr ? end : eol + 1;
+}
+
+// Splits [begin, end) into nr_chunks ranges of whole lines, of roughly
+// equal size. Returns the nr_chunks+1 boundaries; empty ranges are
+// possible for short inputs.
+inline std::vector<const char *> split_lines(const char *begin, const char *end,
+                                             mf::mf_int nr_chunks)
+{
+    std::size_t size = end - begin;
+
+    std::vector<const char *> bounds(nr_chunks+1, end);
+    bounds[0] = begin;
+    for(mf::mf_int i = 1; i < nr_chunks; i++)
+    {
+        const char *p = std::max(begin + size/nr_chunks*i, bounds[i-1]);
+        bounds[i] = (p == begin) ? begin : next_line(p-1, end);
+    }
+
+    return bounds;
+}
+
+inline bool parse_int(const char *&p, const char *end, mf::mf_int &val)
+{
+    const char *s = skip_blank(p, end);
+
+    bool neg = false;
+    if(s != end && (*s == '-' || *s == '+'))
+    {
+        neg = (*s == '-');
+        s++;
+    }
+    if(s == end || !is_digit(*s))
+        return false;
+
+    long long x = 0;
+    for(; s != end && is_digit(*s); s++)
+    {
+        x = x*10 + (*s - '0');
+        if(x > (long long)std::numeric_limits<mf::mf_int>::max() + 1)
+            return false;
+    }
+    if(neg)
+        x = -x;
+    if(x > std::numeric_limits<mf::mf_int>::max())
+        return false;
+
+    val = (mf::mf_int)x;
+    p = s;
+    return true;
+}
+
+inline bool parse_float(const char *&p, const char *end, mf::mf_float &val)
+{
+    static const double pow10[] = {
+        1e0,  1e1,  1e2,  1e3,  1e4,  1e5,  1e6,  1e7,  1e8,  1e9,  1e10, 1e11,
+        1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+    };
+
+    const char *s = skip_blank(p, end);
+
+    bool neg = false;
+    if(s != end && (*s == '-' || *s == '+'))
+    {
+        neg = (*s == '-');
+        s++;
+    }
+
+    // Up to 19 significant digits are kept in the mantissa, the
+    // remaining ones only shift the decimal exponent
+    unsigned long long mant = 0;
+    int nr_digits = 0, exp10 = 0;
+    bool any_digit = false;
+    for(; s != end && is_digit(*s); s++)
+    {
+        any_digit = true;
+        if(nr_digits < 19)
+        {
+            mant = mant*10 + (*s - '0');
+            if(mant != 0)
+                nr_digits++;
+        }
+        else
+        {
+            exp10++;
+        }
+    }
+    if(s != end && *s == '.')
+    {
+        s++;
+        for(; s != end && is_digit(*s); s++)
+        {
+            any_digit = true;
+            if(nr_digits < 19)
+            {
+                mant = mant*10 + (*s - '0');
+                if(mant != 0)
+                    nr_digits++;
+                exp10--;
+            }
+        }
+    }
+    if(!any_digit)
+        return false;
+
+    if(s != end && (*s == 'e' || *s == 'E'))
+    {
+        const char *e = s + 1;
+        bool eneg = false;
+        if(e != end && (*e == '-' || *e == '+'))
+        {
+            eneg = (*e == '-');
+            e++;
+        }
+        if(e != end && is_digit(*e))
+        {
+            int x = 0;
+            for(; e != end && is_digit(*e); e++)
+                if(x < 10000)
+                    x = x*10 + (*e - '0');
+            exp10 += eneg ? -x : x;
+            s = e;
+        }
+    }
+
+    double x = (double)mant;
+    if(mant != 0 && exp10 != 0)
+    {
+        if(exp10 > 0 && exp10 <= 22)
+            x *= pow10[exp10];
+        else if(exp10 < 0 && exp10 >= -22)
+            x /= pow10[-exp10];
+        else
+            x *= std::pow(10.0, exp10);
+    }
+
+    val = (mf::mf_float)(neg ? -x : x);
+    p = s;
+    return true;
+}
+
+
+} // namespace Reco
+
+#endif // RECO_TEXT_H
@@ -1,7 +1,7 @@
+#include <cstdio>
 #include <string>
 #include <fstream>
 #include <iostream>
-#include <sstream>
 #include <cmath>
 #include <stdexcept>
 #include <algorithm>
@@ -10,23 +10,23 @@
 #include <Rcpp.h>
 
 #include "mf.h"
+#include "reco-data.h"
 
 using namespace mf;
 
 struct TrainOption
 {
     TrainOption() : param(mf_get_default_param()), nr_folds(1), do_cv(false) {}
-    std::string tr_path, va_path, model_path;
+    std::string tr_path, va_path, model_path, disk_path;
     mf_parameter param;
     mf_int nr_folds;
     bool do_cv;
 };
 
-TrainOption parse_train_option(SEXP train_path_,
+TrainOption parse_train_option(SEXP train_data_,
                                SEXP model_path_,
                                SEXP opts_)
 {
-    Rcpp::CharacterVector train_path(train_path_);
     Rcpp::CharacterVector model_path(model_path_);
     Rcpp::List opts(opts_);
 
@@ -68,6 +68,26 @@ TrainOption parse_train_option(SEXP train_path_,
     // Whether perform NMF or not
     option.param.do_nmf = Rcpp::as<mf_int>(opts["nmf"]);
 
+    // Storage precision of the factors during training
+    std::string precision = Rcpp::as<std::string>(opts["precision"]);
+    if(precision == "fp32")
+        option.param.precision = MF_FP32;
+    else if(precision == "bf16")
+        option.param.precision = MF_BF16;
+    else if(precision == "fp16")
+        option.param.precision = MF_FP16;
+    else
+        throw std::invalid_argument("precision should be one of \"fp32\", \"bf16\" and \"fp16\"");
+
+    // Lookahead of the row prefetching, negative to choose it from k
+    option.param.prefetch = std::max(Rcpp::as<mf_int>(opts["prefetch"]), -1);
+
+    // Pinning of the threads and placement of their data on NUMA nodes
+    option.param.numa = Rcpp::as<bool>(opts["numa"]);
+
+    // Fixed order of the blocks, so that results do not depend on timing
+    option.param.deterministic = Rcpp::as<bool>(opts["deterministic"]);
+
     // Verbose or not
     option.param.quiet = !(Rcpp::as<bool>(opts["verbose"]));
 
@@ -79,8 +99,14 @@ TrainOption parse_train_option(SEXP train_path_,
     if(option.nr_folds > 1)
         option.do_cv = true;
 
-    // Path to training set
-    option.tr_path = Rcpp::as<std::string>(train_path);
+    // Path to training set, or an empty string if the data are in memory
+    if(Rf_isString(train_data_))
+        option.tr_path = Rcpp::as<std::string>(train_data_);
+
+    // Prefix of temporary files for training on disk, otherwise an empty string
+    option.disk_path = Rcpp::as<std::string>(opts["disk_path"]);
+    if(!option.disk_path.empty() && option.tr_path.empty())
+        throw std::invalid_argument("training on disk requires the training data in a file");
 
     // Path to model file
     option.model_path = Rcpp::as<std::string>(model_path);
@@ -91,75 +117,80 @@ TrainOption parse_train_option(SEXP train_path_,
     return option;
 }
 
-mf_problem read_problem(std::string path)
+// Trains with the training set kept on disk. A text training file is
+// first converted to a temporary binary file.
+mf_model* train_on_disk(TrainOption const &option, mf_problem const *va)
 {
-    mf_problem prob;
-    prob.m = 0;
-    prob.n = 0;
-    prob.nnz = 0;
-    prob.R = nullptr;
-
-    if(path.empty())
+    std::string bin_path = option.tr_path;
+    std::string tmp_path;
+    if(!Reco::is_binary_file(bin_path))
     {
-        return prob;
+        tmp_path = option.disk_path + ".bin";
+        bin_path = tmp_path;
     }
 
-    std::ifstream f(path);
-    if(!f.is_open())
-        throw std::runtime_error("cannot open " + path);
-    std::string line;
-    while(std::getline(f, line))
-        prob.nnz++;
+    std::string block_path = option.disk_path + ".blocks";
 
-    mf_node *R = new mf_node[prob.nnz];
+    mf_model *model = nullptr;
+    try
+    {
+        if(!tmp_path.empty())
+            Reco::convert_to_binary(option.tr_path, tmp_path,
+                                    option.param.nr_threads);
+
+        Reco::BinaryHeader header;
+        Reco::read_binary_header(bin_path, header);
 
-    f.close();
-    f.open(path);
+        mf_disk_problem tr;
+        tr.m = header.m;
+        tr.n = header.n;
+        tr.nnz = header.nnz;
+        tr.path = bin_path.c_str();
+        tr.offset = sizeof(Reco::BinaryHeader);
 
-    mf_node N;
-    mf_long idx = 0, lino = 0;
-    for(lino = 0; lino < prob.nnz; lino++)
+        model = mf_train_on_disk(&tr, va, option.param, block_path.c_str());
+    }
+    catch(...)
     {
-        std::getline(f, line);
-        std::stringstream ss(line);
-
-        ss >> N.u >> N.v >> N.r;
-        if(!ss)
-            continue;
-
-        if(N.u+1 > prob.m)
-            prob.m = N.u+1;
-        if(N.v+1 > prob.n)
-            prob.n = N.v+1;
-        R[idx] = N;
-        idx++;
+        if(!tmp_path.empty())
+            std::remove(tmp_path.c_str());
+        throw;
     }
-    prob.nnz = idx;
-    prob.R = R;
 
-    return prob;
+    if(!tmp_path.empty())
+        std::remove(tmp_path.c_str());
+
+    return model;
 }
 
-RcppExport SEXP reco_train(SEXP train_path, SEXP model_path, SEXP opts)
+RcppExport SEXP reco_train(SEXP train_data, SEXP model_path, SEXP opts)
 {
 BEGIN_RCPP
 
-    TrainOption option = parse_train_option(train_path, model_path, opts);
+    TrainOption option = parse_train_option(train_data, model_path, opts);
 
-    mf_problem tr, va;
-    tr = read_problem(option.tr_path);
-    va = read_problem(option.va_path);
+    Reco::ProblemData va;
+    Reco::read_problem(option.va_path, option.param.nr_threads, va);
 
-    mf_model *model = mf_train_with_validation(&tr, &va, option.param);
+    mf_model *model;
+    if(option.disk_path.empty())
+    {
+        // The nodes are freed once training has packed them
+        Reco::ProblemData tr;
+        Reco::read_problem(train_data, option.param.nr_threads, tr);
+        model = mf_train_with_release(&tr.prob, &va.prob, option.param,
+            [] (void *data) { ((Reco::ProblemData *)data)->release(); }, &tr);
+    }
+    else
+    {
+        model = train_on_disk(option, &va.prob);
+    }
     mf_int status = mf_save_model(model, option.model_path.c_str());
 
     if(status != 0)
     {
         mf_destroy_model(&model);
 
-        delete[] tr.R;
-        delete[] va.R;
-
         std::string msg = "cannot save model to " + option.model_path;
         Rcpp::stop(msg.c_str());
     }
@@ -172,10 +203,16 @@ BEGIN_RCPP
 
     mf_destroy_model(&model);
 
-    delete[] tr.R;
-    delete[] va.R;
-
     return model_param;
 
 END_RCPP
 }
+
+RcppExport SEXP reco_simd_kernel()
+{
+BEGIN_RCPP
+
+    return Rcpp::wrap(std::string(mf_simd_kernel()));
+
+END_RCPP
+}
@@ -1,7 +1,6 @@
 #include <string>
 #include <fstream>
 #include <iostream>
-#include <sstream>
 #include <cmath>
 #include <stdexcept>
 #include <algorithm>
@@ -10,6 +9,7 @@
 #include <Rcpp.h>
 
 #include "mf.h"
+#include "reco-data.h"
 
 using namespace mf;
 
@@ -54,6 +54,9 @@ TuneOption parse_tune_option(SEXP opts_)
     // Whether to perform NMF or not
     option.param.do_nmf = Rcpp::as<mf_int>(opts["nmf"]);
 
+    // Fixed order of the blocks, so that results do not depend on timing
+    option.param.deterministic = Rcpp::as<bool>(opts["deterministic"]);
+
     // Verbose or not
     option.param.quiet = !(Rcpp::as<bool>(opts["verbose"]));
 
@@ -63,56 +66,7 @@ TuneOption parse_tune_option(SEXP opts_)
     return option;
 }
 
-mf_problem read_data(std::string path)
-{
-    mf_problem prob;
-    prob.m = 0;
-    prob.n = 0;
-    prob.nnz = 0;
-    prob.R = nullptr;
-
-    if(path.empty())
-    {
-        return prob;
-    }
-
-    std::ifstream f(path);
-    if(!f.is_open())
-        throw std::runtime_error("cannot open " + path);
-    std::string line;
-    while(std::getline(f, line))
-        prob.nnz++;
-
-    mf_node *R = new mf_node[prob.nnz];
-
-    f.close();
-    f.open(path);
-
-    mf_node N;
-    mf_long idx = 0, lino = 0;
-    for(lino = 0; lino < prob.nnz; lino++)
-    {
-        std::getline(f, line);
-        std::stringstream ss(line);
-
-        ss >> N.u >> N.v >> N.r;
-        if(!ss)
-            continue;
-
-        if(N.u+1 > prob.m)
-            prob.m = N.u+1;
-        if(N.v+1 > prob.n)
-            prob.n = N.v+1;
-        R[idx] = N;
-        idx++;
-    }
-    prob.nnz = idx;
-    prob.R = R;
-
-    return prob;
-}
-
-RcppExport SEXP reco_tune(SEXP train_path_, SEXP opts_tune_, SEXP opts_other_)
+RcppExport SEXP reco_tune(SEXP train_data_, SEXP opts_tune_, SEXP opts_other_)
 {
 BEGIN_RCPP
 
@@ -125,8 +79,8 @@ BEGIN_RCPP
 
     TuneOption option = parse_tune_option(opts_other_);
 
-    std::string train_path = Rcpp::as<std::string>(train_path_);
-    mf_problem tr = read_data(train_path);
+    Reco::ProblemData tr;
+    Reco::read_problem(train_data_, option.param.nr_threads, tr);
 
     for(int i = 0; i < n; i++)
     {
@@ -142,14 +96,12 @@ BEGIN_RCPP
         option.param.lambda = tune_cost[i];
         option.param.eta    = tune_lrate[i];
 
-        rmse[i] = mf_cross_validation(&tr, option.nr_folds, option.param);
+        rmse[i] = mf_cross_validation(&tr.prob, option.nr_folds, option.param);
         
         if(!option.param.quiet)
             Rcpp::Rcout << "==============" << std::endl << std::endl;
     }
 
-    delete[] tr.R;
-
     return rmse;
 
 END_RCPP
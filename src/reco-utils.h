@@ -1,3 +1,4 @@
+#include <cstdint>
 #include <cstdlib>
 #include <Rcpp.h>
 
@@ -52,13 +53,6 @@ inline void free_aligned(void *ptr)
     }
 }
 
-// R implementation of uniform_real_distribution<mf_float>
-inline double rand_unif()
-{
-    Rcpp::RNGScope scp;
-    return R::unif_rand();
-}
-
 // Used in random_shuffle()
 inline int rand_less_than(int i)
 {
@@ -67,5 +61,57 @@ inline int rand_less_than(int i)
     return r % i;
 }
 
+// 64 random bits from the R RNG, to seed an Rng on the main thread
+inline uint64_t rand_seed()
+{
+    Rcpp::RNGScope scp;
+    uint64_t hi = uint64_t(R::unif_rand() * 4294967296.0);
+    uint64_t lo = uint64_t(R::unif_rand() * 4294967296.0);
+    return (hi << 32) | lo;
+}
+
+// xoshiro256** generator (http://prng.di.unimi.it/), for the random numbers
+// needed by worker threads, which must not call the R API. Each stream is
+// seeded from a seed drawn by rand_seed() and a stream index, so results
+// stay under the control of set.seed() and do not depend on the threads.
+class Rng
+{
+public:
+    Rng(uint64_t seed, uint64_t stream = 0)
+    {
+        // Expand the seed with splitmix64, as the xoshiro authors advise
+        uint64_t x = seed ^ (stream * 0xd1342543de82ef95ULL);
+        for(int i = 0; i < 4; i++)
+        {
+            x += 0x9e3779b97f4a7c15ULL;
+            uint64_t z = x;
+            z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+            z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+            s[i] = z ^ (z >> 31);
+        }
+    }
+
+    uint64_t next()
+    {
+        uint64_t result = rotl(s[1] * 5, 7) * 9;
+        uint64_t t = s[1] << 17;
+        s[2] ^= s[0];
+        s[3] ^= s[1];
+        s[1] ^= s[2];
+        s[0] ^= s[3];
+        s[2] ^= t;
+        s[3] = rotl(s[3], 45);
+        return result;
+    }
+
+    // Uniform on [0, 1)
+    double unif() { return double(next() >> 11) * (1.0 / 9007199254740992.0); }
+
+private:
+    static uint64_t rotl(uint64_t x, int k) { return (x << k) | (x >> (64 - k)); }
+
+    uint64_t s[4];
+};
+
 
 } // namespace Reco